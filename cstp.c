@@ -49,23 +49,30 @@
  * 0008: data payload
  */
 
-static char data_hdr[8] = {
+static const char data_hdr[8] = {
 	'S', 'T', 'F', 1,
 	0, 0,		/* Length */
 	AC_PKT_DATA,	/* Type */
 	0		/* Unknown */
 };
 
+/* These are never modified, so they can be shared by all sessions */
+static unsigned char keepalive_hdr[8] = { 'S', 'T', 'F', 1, 0, 0, AC_PKT_KEEPALIVE, 0 };
 static struct pkt keepalive_pkt = {
-	.hdr = { 'S', 'T', 'F', 1, 0, 0, AC_PKT_KEEPALIVE, 0 },
+	.len = 8,
+	.data = keepalive_hdr,
 };
 
+static unsigned char dpd_hdr[8] = { 'S', 'T', 'F', 1, 0, 0, AC_PKT_DPD_OUT, 0 };
 static struct pkt dpd_pkt = {
-	.hdr = { 'S', 'T', 'F', 1, 0, 0, AC_PKT_DPD_OUT, 0 },
+	.len = 8,
+	.data = dpd_hdr,
 };
 
+static unsigned char dpd_resp_hdr[8] = { 'S', 'T', 'F', 1, 0, 0, AC_PKT_DPD_RESP, 0 };
 static struct pkt dpd_resp_pkt = {
-	.hdr = { 'S', 'T', 'F', 1, 0, 0, AC_PKT_DPD_RESP, 0 },
+	.len = 8,
+	.data = dpd_resp_hdr,
 };
 
 static int  __attribute__ ((format (printf, 3, 4)))
@@ -199,8 +206,8 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 	cstp_free_splits(vpninfo);
 
 	/* Create (new) random master key for DTLS connection, if needed */
-	if (vpninfo->dtls_times.last_rekey + vpninfo->dtls_times.rekey <
-	    time(NULL) + 300 &&
+	if (vpninfo->dtls_times.last_rekey + (uint64_t)vpninfo->dtls_times.rekey * 1000 <
+	    vpn_time_ms() + 300000 &&
 	    openconnect_random(vpninfo->dtls_secret, sizeof(vpninfo->dtls_secret))) {
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("Failed to initialise DTLS secret\n"));
@@ -281,6 +288,11 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 	vpninfo->deflate = 0;
 	mtu = 0;
 
+	/* Servers which don't say how to rekey get a new tunnel */
+	vpninfo->ssl_times.rekey_method = REKEY_TUNNEL;
+	vpninfo->dtls_times.rekey_method = REKEY_TUNNEL;
+	vpninfo->dtls_rekey_tunnel = 0;
+
 	while ((i = openconnect_SSL_gets(vpninfo, buf, sizeof(buf)))) {
 		struct oc_vpn_option *new_option;
 		char *colon;
@@ -343,7 +355,14 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 				for (i = 0; i < 64; i += 2)
 					vpninfo->dtls_session_id[i/2] = unhex(colon + i);
 				sessid_found = 1;
-				time(&vpninfo->dtls_times.last_rekey);
+				vpninfo->dtls_times.last_rekey = vpn_time_ms();
+			} else if (!strcmp(buf + 7, "Rekey-Method")) {
+				if (!strcmp(colon, "new-tunnel"))
+					vpninfo->dtls_times.rekey_method = REKEY_TUNNEL;
+				else if (!strcmp(colon, "ssl"))
+					vpninfo->dtls_times.rekey_method = REKEY_SSL;
+				else
+					vpninfo->dtls_times.rekey_method = REKEY_NONE;
 			}
 			continue;
 		}
@@ -360,6 +379,13 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 				vpninfo->ssl_times.dpd = j;
 		} else if (!strcmp(buf + 7, "Rekey-Time")) {
 			vpninfo->ssl_times.rekey = atol(colon);
+		} else if (!strcmp(buf + 7, "Rekey-Method")) {
+			if (!strcmp(colon, "new-tunnel"))
+				vpninfo->ssl_times.rekey_method = REKEY_TUNNEL;
+			else if (!strcmp(colon, "ssl"))
+				vpninfo->ssl_times.rekey_method = REKEY_SSL;
+			else
+				vpninfo->ssl_times.rekey_method = REKEY_NONE;
 		} else if (!strcmp(buf + 7, "Content-Encoding")) {
 			if (!strcmp(colon, "deflate"))
 				vpninfo->deflate = 1;
@@ -493,17 +519,13 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 	vpn_progress(vpninfo, PRG_INFO, _("CSTP connected. DPD %d, Keepalive %d\n"),
 		     vpninfo->ssl_times.dpd, vpninfo->ssl_times.keepalive);
 
-	if (vpninfo->select_nfds <= vpninfo->ssl_fd)
-		vpninfo->select_nfds = vpninfo->ssl_fd + 1;
-
-	FD_SET(vpninfo->ssl_fd, &vpninfo->select_rfds);
-	FD_SET(vpninfo->ssl_fd, &vpninfo->select_efds);
+	monitor_fd_events(vpninfo, vpninfo->ssl_fd, FD_EV_READ | FD_EV_EXCEPT, 0);
 
 	if (!sessid_found)
 		vpninfo->dtls_attempt_period = 0;
 
 	vpninfo->ssl_times.last_rekey = vpninfo->ssl_times.last_rx =
-		vpninfo->ssl_times.last_tx = time(NULL);
+		vpninfo->ssl_times.last_tx = vpn_time_ms();
 	return 0;
 }
 
@@ -512,6 +534,16 @@ int openconnect_make_cstp_connection(struct openconnect_info *vpninfo)
 {
 	int ret;
 
+	/* Frames and rehandshakes are never split across connections */
+	vpninfo->cstp_rx_len = 0;
+	vpninfo->cstp_rekey_start = 0;
+	vpninfo->cstp_rekey_rx = 0;
+	if (!vpninfo->cstp_rx_buf) {
+		vpninfo->cstp_rx_buf = malloc(CSTP_RX_BUF_SIZE);
+		if (!vpninfo->cstp_rx_buf)
+			return -ENOMEM;
+	}
+
 	ret = openconnect_open_https(vpninfo);
 	if (ret)
 		return ret;
@@ -520,32 +552,34 @@ int openconnect_make_cstp_connection(struct openconnect_info *vpninfo)
 		vpninfo->deflate_adler32 = 1;
 		vpninfo->inflate_adler32 = 1;
 
+		vpninfo->compr_level = COMPR_DEFAULT_LEVEL;
+		vpninfo->compr_new_level = 0;
+		vpninfo->compr_period_start = vpn_time_ms();
+		vpninfo->compr_period_us = 0;
+		vpninfo->compr_period_in = vpninfo->compr_period_out = 0;
+		vpninfo->cstp_period_tx = vpninfo->cstp_period_stalled = 0;
+		vpninfo->stats.compr_level = vpninfo->compr_level;
+		vpninfo->stats.cstp_link_rate = 0;
+
 		if (inflateInit2(&vpninfo->inflate_strm, -12) ||
-		    deflateInit2(&vpninfo->deflate_strm, Z_DEFAULT_COMPRESSION,
+		    deflateInit2(&vpninfo->deflate_strm, vpninfo->compr_level,
 				 Z_DEFLATED, -12, 9, Z_DEFAULT_STRATEGY)) {
 			vpn_progress(vpninfo, PRG_ERR, _("Compression setup failed\n"));
 			vpninfo->deflate = 0;
 		}
 
-		if (!vpninfo->deflate_pkt) {
-			vpninfo->deflate_pkt = malloc(sizeof(struct pkt) + 2048);
-			if (!vpninfo->deflate_pkt) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Allocation of deflate buffer failed\n"));
-				inflateEnd(&vpninfo->inflate_strm);
-				deflateEnd(&vpninfo->deflate_strm);
-				vpninfo->deflate = 0;
-			} else {
-				memset(vpninfo->deflate_pkt, 0, sizeof(struct pkt));
-				memcpy(vpninfo->deflate_pkt->hdr, data_hdr, 8);
-				vpninfo->deflate_pkt->hdr[6] = AC_PKT_COMPRESSED;
-			}
-		}
+		/* Don't even try to compress what's probably encrypted,
+		   until it shows us otherwise */
+		memset(vpninfo->compr_class, 0, sizeof(vpninfo->compr_class));
+		vpninfo->compr_class[OC_COMPR_CLASS_ENCRYPTED].bypass = 1;
+		vpninfo->compr_class[OC_COMPR_CLASS_RANDOM].bypass = 1;
 	}
 
 	ret = start_cstp_connection(vpninfo);
 	if (ret < 0)
 		openconnect_close_https(vpninfo, 0);
+	else
+		openconnect_setup_ktls(vpninfo);
 	return ret;
 }
 
@@ -557,13 +591,20 @@ int cstp_reconnect(struct openconnect_info *vpninfo)
 
 	openconnect_close_https(vpninfo, 0);
 
+	/* Reconnecting blocks, which would hold up every other session in
+	   the group. openconnect_group_run() hands it back to the caller
+	   to do instead. */
+	if (vpninfo->group)
+		return -EAGAIN;
+
+	/* Requeue the original packets that current_ssl_pkt was built
+	   from; with compression they'll need to be deflated afresh. */
+	if (vpninfo->pending_ssl_pkts.head) {
+		vpninfo->current_ssl_pkt = NULL;
+		requeue_packets(&vpninfo->outgoing_queue, &vpninfo->pending_ssl_pkts);
+	}
+
 	if (vpninfo->deflate) {
-		/* Requeue the original packet that was deflated */
-		if (vpninfo->current_ssl_pkt == vpninfo->deflate_pkt) {
-			vpninfo->current_ssl_pkt = NULL;
-			queue_packet(&vpninfo->outgoing_queue, vpninfo->pending_deflated_pkt);
-			vpninfo->pending_deflated_pkt = NULL;
-		}
 		inflateEnd(&vpninfo->inflate_strm);
 		deflateEnd(&vpninfo->deflate_strm);
 	}
@@ -598,14 +639,12 @@ int cstp_reconnect(struct openconnect_info *vpninfo)
 static int inflate_and_queue_packet(struct openconnect_info *vpninfo,
 				    unsigned char *buf, int len)
 {
-	struct pkt *new = malloc(sizeof(struct pkt) + vpninfo->ip_info.mtu);
+	struct pkt *new = alloc_pkt(vpninfo, vpninfo->ip_info.mtu);
 	uint32_t pkt_sum;
 
 	if (!new)
 		return -ENOMEM;
 
-	new->next = NULL;
-
 	vpninfo->inflate_strm.next_in = buf;
 	vpninfo->inflate_strm.avail_in = len - 4;
 
@@ -615,7 +654,7 @@ static int inflate_and_queue_packet(struct openconnect_info *vpninfo,
 
 	if (inflate(&vpninfo->inflate_strm, Z_SYNC_FLUSH)) {
 		vpn_progress(vpninfo, PRG_ERR, _("inflate failed\n"));
-		free(new);
+		free_pkt(vpninfo, new);
 		return -EINVAL;
 	}
 
@@ -670,7 +709,7 @@ static int cstp_write(struct openconnect_info *vpninfo, void *buf, int buflen)
 	case SSL_ERROR_WANT_WRITE:
 		/* Waiting for the socket to become writable -- it's
 		   probably stalled, and/or the buffers are full */
-		FD_SET(vpninfo->ssl_fd, &vpninfo->select_wfds);
+		monitor_write_fd(vpninfo, vpninfo->ssl_fd);
 	case SSL_ERROR_WANT_READ:
 		return 0;
 
@@ -680,15 +719,194 @@ static int cstp_write(struct openconnect_info *vpninfo, void *buf, int buflen)
 		return -1;
 	}
 }
+
+/* OpenSSL carries on with any handshake from within SSL_read() and
+   SSL_write(), so the tunnel keeps running while it happens. */
+#define CSTP_REKEY_BLOCKS 0
+
+/* Push the rehandshake or KeyUpdate along. OpenSSL would otherwise only
+   send it from within SSL_write(), which may not be called for a while
+   on an idle link. Returns 0 when it's done, 1 while it's waiting for
+   the socket, or -EIO. */
+static int cstp_drive_rekey(struct openconnect_info *vpninfo)
+{
+	int ret = SSL_do_handshake(vpninfo->https_ssl);
+
+	if (ret > 0)
+		return 0;
+
+	switch (SSL_get_error(vpninfo->https_ssl, ret)) {
+	case SSL_ERROR_WANT_WRITE:
+		monitor_write_fd(vpninfo, vpninfo->ssl_fd);
+	case SSL_ERROR_WANT_READ:
+		return 1;
+	}
+	return -EIO;
+}
+
+/* Rekey the existing TLS session. cstp_continue_rekey() keeps it going
+   until it's finished, or times out. */
+static int cstp_start_rekey(struct openconnect_info *vpninfo)
+{
+	vpninfo->cstp_rekey_start = vpninfo->now;
+
+#ifdef SSL_KEY_UPDATE_REQUESTED
+	if (SSL_version(vpninfo->https_ssl) >= TLS1_3_VERSION) {
+		/* Ask the server to update its keys, along with ours */
+		if (!SSL_key_update(vpninfo->https_ssl, SSL_KEY_UPDATE_REQUESTED))
+			goto err;
+	} else
+#endif
+	if (!SSL_renegotiate(vpninfo->https_ssl))
+		goto err;
+
+	if (cstp_drive_rekey(vpninfo) >= 0)
+		return 0;
+ err:
+	vpn_progress(vpninfo, PRG_ERR, _("Failed to start TLS rehandshake\n"));
+	openconnect_report_ssl_errors(vpninfo);
+	return -EIO;
+}
+
+static int cstp_rekey_pending(struct openconnect_info *vpninfo)
+{
+#ifdef SSL_KEY_UPDATE_REQUESTED
+	if (SSL_version(vpninfo->https_ssl) >= TLS1_3_VERSION)
+		/* Until our KeyUpdate has gone out */
+		return SSL_get_key_update_type(vpninfo->https_ssl) != SSL_KEY_UPDATE_NONE;
+#endif
+	return SSL_renegotiate_pending(vpninfo->https_ssl);
+}
+
+/* Returns 0 when the rekey is complete, 1 while it's still going, or
+   a negative error */
+static int cstp_continue_rekey(struct openconnect_info *vpninfo)
+{
+	/* A half-written record has to be finished by SSL_write() first,
+	   which will carry on with the handshake itself */
+	if (!cstp_rekey_pending(vpninfo) || vpninfo->current_ssl_pkt)
+		return cstp_rekey_pending(vpninfo);
+
+	if (cstp_drive_rekey(vpninfo) < 0) {
+		openconnect_report_ssl_errors(vpninfo);
+		return -EIO;
+	}
+	return cstp_rekey_pending(vpninfo);
+}
 #elif defined(OPENCONNECT_GNUTLS)
+#ifdef HAVE_KTLS
+/* With kernel TLS, records other than application data come with their
+   type in a control message, and must be read separately. */
+static int ktls_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
+{
+	char cmsgbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int ret;
+
+ again:
+	iov.iov_base = buf;
+	iov.iov_len = maxlen;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+
+	ret = recvmsg(vpninfo->ssl_fd, &msg, 0);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	if (ret <= 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("SSL read error: %s; reconnecting.\n"),
+			     ret ? strerror(errno) : _("connection closed"));
+		return -EIO;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_TLS &&
+	    cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+		unsigned char type = *(unsigned char *)CMSG_DATA(cmsg);
+
+		if (type == 21 /* alert */) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Received TLS alert %d; reconnecting.\n"),
+				     ret > 1 ? ((unsigned char *)buf)[1] : -1);
+			return -EIO;
+		}
+		if (type == 22 /* handshake */) {
+			/* Only TLS 1.2 gets here, so it's a HelloRequest,
+			   which the client is allowed to ignore. */
+			vpn_progress(vpninfo, PRG_TRACE,
+				     _("Ignoring TLS rehandshake request\n"));
+			goto again;
+		}
+		if (type != 23 /* application data */) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Unexpected TLS record of type %d; reconnecting.\n"),
+				     type);
+			return -EIO;
+		}
+	}
+	return ret;
+}
+
+/* The kernel may send only some of it, but cstp_write() is all or
+   nothing. Keep count and report it sent once it's all gone. Nothing
+   else can be sent until then, or it would land in the middle of it. */
+static int ktls_write(struct openconnect_info *vpninfo, void *buf, int buflen)
+{
+	int ret;
+
+	if (vpninfo->ktls_tx_sent && buf != vpninfo->ktls_tx_buf) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("SSL send failed: previous write incomplete\n"));
+		return -1;
+	}
+	vpninfo->ktls_tx_buf = buf;
+
+	ret = send(vpninfo->ssl_fd, (char *)buf + vpninfo->ktls_tx_sent,
+		   buflen - vpninfo->ktls_tx_sent, MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			vpn_progress(vpninfo, PRG_ERR, _("SSL send failed: %s\n"),
+				     strerror(errno));
+			vpninfo->ktls_tx_sent = 0;
+			return -1;
+		}
+		ret = 0;
+	}
+
+	vpninfo->ktls_tx_sent += ret;
+	if (vpninfo->ktls_tx_sent < buflen) {
+		monitor_write_fd(vpninfo, vpninfo->ssl_fd);
+		return 0;
+	}
+	vpninfo->ktls_tx_sent = 0;
+	return buflen;
+}
+#endif
+
 static int cstp_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
 {
 	int ret;
 
+#ifdef HAVE_KTLS
+	if (vpninfo->ktls_rx)
+		return ktls_read(vpninfo, buf, maxlen);
+#endif
 	ret = gnutls_record_recv(vpninfo->https_sess, buf, maxlen);
 	if (ret > 0)
 		return ret;
 
+	if (ret == GNUTLS_E_REHANDSHAKE) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Server requested TLS rehandshake\n"));
+		vpninfo->cstp_rekey_start = vpninfo->now;
+		return 0;
+	}
+
 	if (ret != GNUTLS_E_AGAIN) {
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("SSL read error: %s; reconnecting.\n"),
@@ -702,6 +920,10 @@ static int cstp_write(struct openconnect_info *vpninfo, void *buf, int buflen)
 {
 	int ret;
 
+#ifdef HAVE_KTLS
+	if (vpninfo->ktls_tx)
+		return ktls_write(vpninfo, buf, buflen);
+#endif
 	ret = gnutls_record_send(vpninfo->https_sess, buf, buflen);
 	if (ret > 0)
 		return ret;
@@ -710,7 +932,7 @@ static int cstp_write(struct openconnect_info *vpninfo, void *buf, int buflen)
 		if (gnutls_record_get_direction(vpninfo->https_sess)) {
 			/* Waiting for the socket to become writable -- it's
 			   probably stalled, and/or the buffers are full */
-			FD_SET(vpninfo->ssl_fd, &vpninfo->select_wfds);
+			monitor_write_fd(vpninfo, vpninfo->ssl_fd);
 		}
 		return 0;
 	}
@@ -718,11 +940,465 @@ static int cstp_write(struct openconnect_info *vpninfo, void *buf, int buflen)
 		     gnutls_strerror(ret));
 	return -1;
 }
+
+/* Returns 0 when the rekey is complete, 1 while it's waiting for the
+   socket, 2 if application data must be read before it can continue,
+   or a negative error if the server refused. */
+static int cstp_continue_rekey(struct openconnect_info *vpninfo)
+{
+	int ret;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+	if (gnutls_protocol_get_version(vpninfo->https_sess) == GNUTLS_TLS1_3)
+		/* Update our keys, and ask the server to update its own */
+		ret = gnutls_session_key_update(vpninfo->https_sess, GNUTLS_KU_PEER);
+	else
 #endif
+		ret = gnutls_handshake(vpninfo->https_sess);
+
+	if (ret == GNUTLS_E_GOT_APPLICATION_DATA)
+		return 2;
+
+	if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+		if (gnutls_record_get_direction(vpninfo->https_sess))
+			monitor_write_fd(vpninfo, vpninfo->ssl_fd);
+		return 1;
+	}
+
+	if (ret) {
+		vpn_progress(vpninfo, PRG_ERR, _("TLS rehandshake failed: %s\n"),
+			     gnutls_strerror(ret));
+		return -EIO;
+	}
+	return 0;
+}
+
+/* GnuTLS can't send application data in the middle of a handshake, so
+   the rest of the mainloop holds off until cstp_continue_rekey() is done. */
+#define CSTP_REKEY_BLOCKS 1
+
+static int cstp_start_rekey(struct openconnect_info *vpninfo)
+{
+	vpninfo->cstp_rekey_start = vpninfo->now;
+	return 0;
+}
+#endif
+
+/* The most space that an STF frame for a packet of len bytes can take */
+static int stf_frame_room(struct openconnect_info *vpninfo, int len)
+{
+	if (vpninfo->deflate)
+		/* deflateBound() doesn't allow for the sync flush marker */
+		return 8 + deflateBound(&vpninfo->deflate_strm, len) + 8 + 4;
+
+	return 8 + len;
+}
+
+static int is_encrypted_port(int proto, int port)
+{
+	if (proto == IPPROTO_TCP)
+		/* SSH, HTTPS, SMTPS, DNS over TLS, IMAPS, POP3S */
+		return port == 22 || port == 443 || port == 465 ||
+			port == 853 || port == 993 || port == 995;
+
+	/* QUIC, DNS over DTLS, IPsec NAT-T, WireGuard */
+	return port == 443 || port == 853 || port == 4500 || port == 51820;
+}
+
+/* Guess from its headers whether an IP packet carries encrypted data,
+   or failing that, sample its payload to see if it looks random. This
+   has to be a lot cheaper than just compressing it to find out. */
+static int compr_classify(const unsigned char *data, int len)
+{
+	const unsigned char *l4, *payload;
+	uint32_t seen[8];
+	int hlen, proto, i, nr_seen;
+
+	if (len >= 20 && (data[0] >> 4) == 4) {
+		hlen = (data[0] & 0xf) * 4;
+		proto = data[9];
+		/* No ports in the later fragments */
+		if ((data[6] & 0x1f) || data[7])
+			proto = 0;
+	} else if (len >= 40 && (data[0] >> 4) == 6) {
+		hlen = 40;
+		proto = data[6];
+	} else
+		return OC_COMPR_CLASS_OTHER;
+
+	if (hlen > len)
+		return OC_COMPR_CLASS_OTHER;
+
+	l4 = payload = data + hlen;
+	if (proto == IPPROTO_ESP)
+		return OC_COMPR_CLASS_ENCRYPTED;
+
+	if ((proto == IPPROTO_TCP && len >= hlen + 20) ||
+	    (proto == IPPROTO_UDP && len >= hlen + 8)) {
+		if (is_encrypted_port(proto, (l4[0] << 8) | l4[1]) ||
+		    is_encrypted_port(proto, (l4[2] << 8) | l4[3]))
+			return OC_COMPR_CLASS_ENCRYPTED;
+
+		if (proto == IPPROTO_TCP)
+			payload = l4 + (l4[12] >> 4) * 4;
+		else
+			payload = l4 + 8;
+
+		/* TLS records on some other port */
+		if (proto == IPPROTO_TCP && payload + 5 <= data + len &&
+		    payload[0] >= 0x14 && payload[0] <= 0x17 &&
+		    payload[1] == 3 && payload[2] <= 4)
+			return OC_COMPR_CLASS_ENCRYPTED;
+	}
+
+	/* 64 random bytes have 57 different values on average; text and
+	   most uncompressed binary formats have far fewer. */
+	if (payload + 128 > data + len)
+		return OC_COMPR_CLASS_OTHER;
+
+	payload += (data + len - payload - 64) / 2;
+	memset(seen, 0, sizeof(seen));
+	nr_seen = 0;
+	for (i = 0; i < 64; i++) {
+		uint32_t bit = 1U << (payload[i] & 31);
+
+		if (!(seen[payload[i] >> 5] & bit)) {
+			seen[payload[i] >> 5] |= bit;
+			nr_seen++;
+		}
+	}
+	return nr_seen >= 48 ? OC_COMPR_CLASS_RANDOM : OC_COMPR_CLASS_OTHER;
+}
+
+/* Returns the packet's class if it should be compressed, or -1 if not */
+static int compr_wanted(struct openconnect_info *vpninfo, struct pkt *this)
+{
+	int cls = compr_classify(this->data, this->len);
+	struct compr_class *cc = &vpninfo->compr_class[cls];
+
+	if (vpninfo->compr_level &&
+	    (!cc->bypass || ++cc->probe >= COMPR_PROBE_INTERVAL)) {
+		cc->probe = 0;
+		return cls;
+	}
+
+	vpninfo->stats.compr_bypass_bytes[cls] += this->len;
+	return -1;
+}
+
+/* Keep the class's compression ratio up to date, and only keep
+   compressing it while that saves at least an eighth. */
+static void compr_account(struct openconnect_info *vpninfo, int cls,
+			  int in, int out)
+{
+	struct compr_class *cc = &vpninfo->compr_class[cls];
+
+	vpninfo->stats.compr_in_bytes[cls] += in;
+	vpninfo->stats.compr_out_bytes[cls] += out;
+
+	cc->in += in;
+	cc->out += out;
+	if (cc->in < COMPR_MIN_SAMPLE)
+		return;
+
+	if (cc->bypass != (cc->out > cc->in - cc->in / 8)) {
+		cc->bypass = !cc->bypass;
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("%s compression for traffic class %d (%lu%% of original size)\n"),
+			     cc->bypass ? _("Disabling") : _("Enabling"), cls,
+			     cc->out * 100 / cc->in);
+	}
+	if (cc->in >= COMPR_WINDOW) {
+		cc->in /= 2;
+		cc->out /= 2;
+	}
+}
+
+static void compr_level_changed(struct openconnect_info *vpninfo, int level)
+{
+	vpninfo->compr_level = level;
+	vpninfo->stats.compr_level = level;
+	vpninfo->stats.compr_level_changes++;
+}
+
+static void compr_set_level(struct openconnect_info *vpninfo, int level)
+{
+	vpninfo->compr_new_level = 0;
+
+	if (!level) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Suspending compression\n"));
+		vpninfo->compr_resume = vpninfo->now + COMPR_SUSPEND_TIME;
+	} else if (!vpninfo->compr_level) {
+		/* It's only suspended from level 1, and the deflate
+		   stream has been left at that. */
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Compression level %d\n"), level);
+	} else {
+		/* deflateParams() may need to flush the stream, so it's
+		   left to append_stf_frame(), where there's somewhere for
+		   the output to go. */
+		vpninfo->compr_new_level = level;
+		return;
+	}
+	compr_level_changed(vpninfo, level);
+}
+
+/* Switch the deflate stream to the new level, with its output (if any)
+   going wherever deflate_strm.next_out points. */
+static void compr_apply_level(struct openconnect_info *vpninfo)
+{
+	int level = vpninfo->compr_new_level;
+	int ret;
+
+	vpninfo->compr_new_level = 0;
+	vpninfo->deflate_strm.avail_in = 0;
+	ret = deflateParams(&vpninfo->deflate_strm, level, Z_DEFAULT_STRATEGY);
+	if (ret != Z_OK) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to set compression level %d: %d\n"),
+			     level, ret);
+		return;
+	}
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Compression level %d\n"), level);
+	compr_level_changed(vpninfo, level);
+}
+
+/* Once a second, see how compression is doing and adjust the level.
+   Go down a level if deflate() takes more than its share of the CPU,
+   or if it's slower than the connection can take the data anyway, and
+   suspend compression altogether after level 1. Go up a level if the
+   connection is the bottleneck, compression is paying off, and there's
+   plenty of CPU budget to spare. When suspended, try again with level 1
+   once the connection is the bottleneck again. */
+static void compr_adjust(struct openconnect_info *vpninfo)
+{
+	uint64_t elapsed = vpninfo->now - vpninfo->compr_period_start;
+	unsigned long in = vpninfo->compr_period_in;
+	unsigned long out = vpninfo->compr_period_out;
+	int stalled = vpninfo->cstp_period_stalled;
+	int level = vpninfo->compr_level;
+	int cpu;
+
+	if (elapsed < COMPR_ADJUST_INTERVAL)
+		return;
+
+	cpu = vpninfo->compr_period_us / (elapsed * 10);
+	vpninfo->stats.compr_cpu_pct = cpu;
+
+	if (stalled) {
+		uint64_t rate = vpninfo->cstp_period_tx * 1000 / elapsed;
+
+		if (vpninfo->stats.cstp_link_rate)
+			rate = (vpninfo->stats.cstp_link_rate * 3 + rate) / 4;
+		vpninfo->stats.cstp_link_rate = rate;
+	}
+
+	if (!level) {
+		if (stalled && vpninfo->now >= vpninfo->compr_resume)
+			compr_set_level(vpninfo, 1);
+	} else if (in) {
+		/* Bytes per second that deflate() can manage */
+		uint64_t speed = (uint64_t)in * 1000000 /
+			(vpninfo->compr_period_us ? : 1);
+
+		if (cpu > vpninfo->compr_cpu_budget ||
+		    speed < vpninfo->stats.cstp_link_rate)
+			compr_set_level(vpninfo, level - 1);
+		else if (stalled && level < 9 &&
+			 cpu * 2 < vpninfo->compr_cpu_budget &&
+			 out < in - in / 8)
+			compr_set_level(vpninfo, level + 1);
+	}
+
+	vpninfo->compr_period_start = vpninfo->now;
+	vpninfo->compr_period_us = 0;
+	vpninfo->compr_period_in = vpninfo->compr_period_out = 0;
+	vpninfo->cstp_period_tx = vpninfo->cstp_period_stalled = 0;
+}
+
+/* Append an STF frame carrying 'this' to the batch, compressing it if
+   compression is enabled and the packet looks like it's worth it. */
+static void append_stf_frame(struct openconnect_info *vpninfo,
+			     struct pkt *batch, struct pkt *this)
+{
+	unsigned char *hdr = pkt_put(batch, 8);
+	int payload_len, cls;
+
+	memcpy(hdr, data_hdr, 8);
+
+	/* Anything sent uncompressed doesn't go through the deflate
+	   stream at all, so the server's inflate state isn't affected. */
+	if (vpninfo->deflate && (cls = compr_wanted(vpninfo, this)) >= 0) {
+		unsigned char *adler;
+		uint64_t start = vpn_time_us();
+		int ret;
+
+		vpninfo->deflate_strm.next_out = hdr + 8;
+		vpninfo->deflate_strm.avail_out = pkt_tailroom(batch) - 4;
+		vpninfo->deflate_strm.total_out = 0;
+
+		if (vpninfo->compr_new_level)
+			compr_apply_level(vpninfo);
+
+		vpninfo->deflate_strm.next_in = this->data;
+		vpninfo->deflate_strm.avail_in = this->len;
+		ret = deflate(&vpninfo->deflate_strm, Z_SYNC_FLUSH);
+		vpninfo->compr_period_us += vpn_time_us() - start;
+		if (ret) {
+			vpn_progress(vpninfo, PRG_ERR, _("deflate failed %d\n"), ret);
+			goto uncompr;
+		}
+		pkt_put(batch, vpninfo->deflate_strm.total_out);
+
+		/* Add ongoing adler32 to tail of compressed packet */
+		vpninfo->deflate_adler32 = adler32(vpninfo->deflate_adler32,
+						   this->data, this->len);
+
+		adler = pkt_put(batch, 4);
+		*(adler++) =  vpninfo->deflate_adler32 >> 24;
+		*(adler++) = (vpninfo->deflate_adler32 >> 16) & 0xff;
+		*(adler++) = (vpninfo->deflate_adler32 >> 8) & 0xff;
+		*(adler)   =  vpninfo->deflate_adler32 & 0xff;
+
+		payload_len = vpninfo->deflate_strm.total_out + 4;
+		hdr[6] = AC_PKT_COMPRESSED;
+		compr_account(vpninfo, cls, this->len, payload_len);
+		vpninfo->compr_period_in += this->len;
+		vpninfo->compr_period_out += payload_len;
+
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Sending compressed data packet of %d bytes\n"),
+			     this->len);
+	} else {
+	uncompr:
+		memcpy(pkt_put(batch, this->len), this->data, this->len);
+		payload_len = this->len;
+
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Sending uncompressed data packet of %d bytes\n"),
+			     this->len);
+	}
+	hdr[4] = payload_len >> 8;
+	hdr[5] = payload_len & 0xff;
+}
+
+/* Handle a single complete STF frame. If pkt is non-NULL, its data are
+   the frame's payload and it may be queued as it is. Returns 1 if a data
+   packet was received, or a negative error if the session should end. */
+static int cstp_handle_frame(struct openconnect_info *vpninfo,
+			     unsigned char *buf, struct pkt *pkt)
+{
+	unsigned char *payload = buf + 8;
+	int payload_len = (buf[4] << 8) + buf[5];
+
+	if (buf[0] != 'S' || buf[1] != 'T' ||
+	    buf[2] != 'F' || buf[3] != 1 || buf[7])
+		goto unknown_pkt;
+
+	vpninfo->ssl_times.last_rx = vpninfo->now;
+	switch (buf[6]) {
+	case AC_PKT_DPD_OUT:
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Got CSTP DPD request\n"));
+		vpninfo->owe_ssl_dpd_response = 1;
+		return 0;
+
+	case AC_PKT_DPD_RESP:
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Got CSTP DPD response\n"));
+		return 0;
+
+	case AC_PKT_KEEPALIVE:
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Got CSTP Keepalive\n"));
+		return 0;
+
+	case AC_PKT_DATA:
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Received uncompressed data packet of %d bytes\n"),
+			     payload_len);
+		if (pkt) {
+			queue_packet(&vpninfo->incoming_queue, pkt);
+			vpninfo->cstp_pkt = NULL;
+		} else if (queue_new_packet(vpninfo, &vpninfo->incoming_queue,
+					    payload, payload_len))
+			vpn_progress(vpninfo, PRG_ERR, "Allocation failed\n");
+		return 1;
+
+	case AC_PKT_DISCONN: {
+		int i;
+
+		for (i = 1; i < payload_len; i++) {
+			if (!isprint(payload[i]))
+				payload[i] = '.';
+		}
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Received server disconnect: %02x '%.*s'\n"),
+			     payload_len ? payload[0] : 0,
+			     payload_len > 1 ? payload_len - 1 : 0, payload + 1);
+		vpninfo->quit_reason = "Server request";
+		return -EPIPE;
+	}
+	case AC_PKT_COMPRESSED:
+		if (!vpninfo->deflate) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Compressed packet received in !deflate mode\n"));
+			goto unknown_pkt;
+		}
+		inflate_and_queue_packet(vpninfo, payload, payload_len);
+		return 1;
+
+	case AC_PKT_TERM_SERVER:
+		vpn_progress(vpninfo, PRG_ERR, _("received server terminate packet\n"));
+		vpninfo->quit_reason = "Server request";
+		return -EPIPE;
+	}
+
+ unknown_pkt:
+	vpn_progress(vpninfo, PRG_ERR,
+		     _("Unknown packet %02x %02x %02x %02x %02x %02x %02x %02x\n"),
+		     buf[0], buf[1], buf[2], buf[3],
+		     buf[4], buf[5], buf[6], buf[7]);
+	vpninfo->quit_reason = "Unknown packet received";
+	return -EINVAL;
+}
+
+/* Handle every complete frame in the reassembly buffer, keeping any
+   partial frame at the end of it for the next read. */
+static int cstp_reassemble(struct openconnect_info *vpninfo)
+{
+	unsigned char *buf = vpninfo->cstp_rx_buf;
+	int len = vpninfo->cstp_rx_len;
+	int ret, work_done = 0;
+
+	while (len >= 8) {
+		int frame_len = 8 + (buf[4] << 8) + buf[5];
+
+		/* Wait for the rest of it, unless it's garbage anyway */
+		if (len < frame_len && buf[0] == 'S' && buf[1] == 'T' &&
+		    buf[2] == 'F' && buf[3] == 1)
+			break;
+
+		ret = cstp_handle_frame(vpninfo, buf, NULL);
+		if (ret < 0) {
+			vpninfo->cstp_rx_len = 0;
+			return ret;
+		}
+		work_done |= ret;
+		buf += frame_len;
+		len -= frame_len;
+	}
+
+	if (len && buf != vpninfo->cstp_rx_buf)
+		memmove(vpninfo->cstp_rx_buf, buf, len);
+	vpninfo->cstp_rx_len = len;
+	return work_done;
+}
 
 int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
-	unsigned char buf[16384];
 	int len, ret;
 	int work_done = 0;
 
@@ -735,111 +1411,111 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	   we should probably remove POLLIN from the events we're looking for,
 	   and add POLLOUT. As it is, though, it'll just chew CPU time in that
 	   fairly unlikely situation, until the write backlog clears. */
-	while ((len = cstp_read(vpninfo, buf, sizeof(buf))) > 0) {
-		int payload_len;
-
-		if (buf[0] != 'S' || buf[1] != 'T' ||
-		    buf[2] != 'F' || buf[3] != 1 || buf[7])
-			goto unknown_pkt;
-
-		payload_len = (buf[4] << 8) + buf[5];
-		if (len != 8 + payload_len) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Unexpected packet length. SSL_read returned %d but packet is\n"),
-				     len);
-			vpn_progress(vpninfo, PRG_ERR,
-				     "%02x %02x %02x %02x %02x %02x %02x %02x\n",
-				     buf[0], buf[1], buf[2], buf[3],
-				     buf[4], buf[5], buf[6], buf[7]);
-			continue;
+	/* While rekeying, only the handshake may use the session, unless
+	   it's waiting for us to read some application data first. */
+	while (!(CSTP_REKEY_BLOCKS && vpninfo->cstp_rekey_start) ||
+	       vpninfo->cstp_rekey_rx) {
+		struct pkt *pkt;
+		unsigned char *buf;
+
+		vpninfo->cstp_rekey_rx = 0;
+
+		if (vpninfo->cstp_rx_len) {
+			/* We have part of a frame already. Read the rest of
+			   it, and whatever follows, into the reassembly buffer. */
+			len = cstp_read(vpninfo,
+					vpninfo->cstp_rx_buf + vpninfo->cstp_rx_len,
+					CSTP_RX_BUF_SIZE - vpninfo->cstp_rx_len);
+			if (len <= 0)
+				break;
+
+			vpninfo->cstp_rx_len += len;
+			ret = cstp_reassemble(vpninfo);
+			goto handled;
 		}
-		vpninfo->ssl_times.last_rx = time(NULL);
-		switch (buf[6]) {
-		case AC_PKT_DPD_OUT:
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Got CSTP DPD request\n"));
-			vpninfo->owe_ssl_dpd_response = 1;
-			continue;
 
-		case AC_PKT_DPD_RESP:
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Got CSTP DPD response\n"));
-			continue;
+		/* Read straight into a packet, with the STF header landing
+		   in the headroom. In the usual case of a record holding a
+		   single frame, data packets can then be queued for the tun
+		   device as they are. */
+		pkt = get_rx_pkt(vpninfo, &vpninfo->cstp_pkt, vpninfo->ip_info.mtu);
+		if (!pkt) {
+			vpn_progress(vpninfo, PRG_ERR, "Allocation failed\n");
+			len = 0;
+			break;
+		}
+		buf = pkt_push(pkt, 8);
 
-		case AC_PKT_KEEPALIVE:
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Got CSTP Keepalive\n"));
-			continue;
+		len = cstp_read(vpninfo, buf, pkt->len + pkt_tailroom(pkt));
+		if (len <= 0)
+			break;
 
-		case AC_PKT_DATA:
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Received uncompressed data packet of %d bytes\n"),
-				     payload_len);
-			queue_new_packet(&vpninfo->incoming_queue, buf + 8,
-					 payload_len);
+		if (len >= 8 && len == 8 + (buf[4] << 8) + buf[5]) {
+			pkt->len = len;
+			pkt_pull(pkt, 8);
+			ret = cstp_handle_frame(vpninfo, buf, pkt);
+		} else {
+			/* Several frames, or only part of one */
+			memcpy(vpninfo->cstp_rx_buf, buf, len);
+			vpninfo->cstp_rx_len = len;
+			ret = cstp_reassemble(vpninfo);
+		}
+	handled:
+		if (ret == -EINVAL)
+			return 1;
+		if (ret < 0)
+			return ret;
+		if (ret)
 			work_done = 1;
-			continue;
+	}
+	if (len < 0)
+		goto do_reconnect;
 
-		case AC_PKT_DISCONN: {
-			int i;
-			for (i = 0; i < payload_len; i++) {
-				if (!isprint(buf[payload_len + 8 + i]))
-					buf[payload_len + 8 + i] = '.';
-			}
-			buf[payload_len + 8] = 0;
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Received server disconnect: %02x '%s'\n"),
-				     buf[8], buf + 9);
-			vpninfo->quit_reason = "Server request";
-			return -EPIPE;
+	if (vpninfo->cstp_rekey_start) {
+		uint64_t due = vpninfo->cstp_rekey_start + CSTP_REKEY_TIMEOUT;
+
+		ret = cstp_continue_rekey(vpninfo);
+		if (ret < 0)
+			goto rekey_failed;
+		if (ret == 2) {
+			vpninfo->cstp_rekey_rx = 1;
+			return 1;
 		}
-		case AC_PKT_COMPRESSED:
-			if (!vpninfo->deflate) {
+		if (ret) {
+			if (vpninfo->now >= due) {
 				vpn_progress(vpninfo, PRG_ERR,
-					     _("Compressed packet received in !deflate mode\n"));
-				goto unknown_pkt;
+					     _("TLS rehandshake timed out\n"));
+				goto rekey_failed;
 			}
-			inflate_and_queue_packet(vpninfo, buf + 8, payload_len);
-			work_done = 1;
-			continue;
-
-		case AC_PKT_TERM_SERVER:
-			vpn_progress(vpninfo, PRG_ERR, _("received server terminate packet\n"));
-			vpninfo->quit_reason = "Server request";
-			return -EPIPE;
+			set_deadline(timeout, due, vpninfo->now);
+			if (CSTP_REKEY_BLOCKS)
+				return work_done;
+		} else {
+			vpn_progress(vpninfo, PRG_INFO, _("CSTP rekey complete\n"));
+			vpninfo->cstp_rekey_start = 0;
 		}
-
-	unknown_pkt:
-		vpn_progress(vpninfo, PRG_ERR,
-			     _("Unknown packet %02x %02x %02x %02x %02x %02x %02x %02x\n"),
-			     buf[0], buf[1], buf[2], buf[3],
-			     buf[4], buf[5], buf[6], buf[7]);
-		vpninfo->quit_reason = "Unknown packet received";
-		return 1;
 	}
-	if (len < 0)
-		goto do_reconnect;
-
 
 	/* If SSL_write() fails we are expected to try again. With exactly
 	   the same data, at exactly the same location. So we keep the
 	   packet we had before.... */
 	if (vpninfo->current_ssl_pkt) {
 	handle_outgoing:
-		vpninfo->ssl_times.last_tx = time(NULL);
-		FD_CLR(vpninfo->ssl_fd, &vpninfo->select_wfds);
+		vpninfo->ssl_times.last_tx = vpninfo->now;
+		unmonitor_write_fd(vpninfo, vpninfo->ssl_fd);
 
 		ret = cstp_write(vpninfo,
-				 vpninfo->current_ssl_pkt->hdr,
-				 vpninfo->current_ssl_pkt->len + 8);
+				 vpninfo->current_ssl_pkt->data,
+				 vpninfo->current_ssl_pkt->len);
 		if (ret < 0)
 			goto do_reconnect;
 		else if (!ret) {
+			vpninfo->cstp_period_stalled = 1;
 			/* -EAGAIN: cstp_write() will have added the SSL fd to
 			   ->select_wfds if appropriate, so we can just return
 			   and wait. Unless it's been stalled for so long that
 			   DPD kicks in and we kill the connection. */
-			switch (ka_stalled_action(&vpninfo->ssl_times, timeout)) {
+			switch (ka_stalled_action(&vpninfo->ssl_times, vpninfo->now, timeout)) {
 			case KA_DPD_DEAD:
 				goto peer_dead;
 			case KA_REKEY:
@@ -852,20 +1528,29 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			}
 		}
 
-		if (ret != vpninfo->current_ssl_pkt->len + 8) {
+		if (ret != vpninfo->current_ssl_pkt->len) {
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("SSL wrote too few bytes! Asked for %d, sent %d\n"),
-				     vpninfo->current_ssl_pkt->len + 8, ret);
+				     vpninfo->current_ssl_pkt->len, ret);
 			vpninfo->quit_reason = "Internal error";
 			return 1;
 		}
+		vpninfo->cstp_period_tx += ret;
+
 		/* Don't free the 'special' packets */
-		if (vpninfo->current_ssl_pkt == vpninfo->deflate_pkt)
-			free(vpninfo->pending_deflated_pkt);
-		else if (vpninfo->current_ssl_pkt != &dpd_pkt &&
-			 vpninfo->current_ssl_pkt != &dpd_resp_pkt &&
-			 vpninfo->current_ssl_pkt != &keepalive_pkt)
-			free(vpninfo->current_ssl_pkt);
+		if (vpninfo->pending_ssl_pkts.head) {
+			struct pkt *this;
+
+			while ((this = dequeue_packet(&vpninfo->pending_ssl_pkts))) {
+				tx_pkt_sent(vpninfo, this);
+				free_pkt(vpninfo, this);
+			}
+		} else if (vpninfo->current_ssl_pkt != &dpd_pkt &&
+			   vpninfo->current_ssl_pkt != &dpd_resp_pkt &&
+			   vpninfo->current_ssl_pkt != &keepalive_pkt) {
+			tx_pkt_sent(vpninfo, vpninfo->current_ssl_pkt);
+			free_pkt(vpninfo, vpninfo->current_ssl_pkt);
+		}
 
 		vpninfo->current_ssl_pkt = NULL;
 	}
@@ -876,14 +1561,27 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		goto handle_outgoing;
 	}
 
-	switch (keepalive_action(&vpninfo->ssl_times, timeout)) {
+	switch (keepalive_action(&vpninfo->ssl_times, vpninfo->now, timeout)) {
 	case KA_REKEY:
 	do_rekey:
-		/* Not that this will ever happen; we don't even process
-		   the setting when we're asked for it. */
 		vpn_progress(vpninfo, PRG_INFO, _("CSTP rekey due\n"));
+		vpninfo->ssl_times.last_rekey = vpninfo->now;
+
+		/* Rehandshake in place if the server allows it; the tunnel
+		   doesn't have to be torn down and set up again. Not if
+		   we're stuck half way through sending a record, or if the
+		   kernel has the keys, though. */
+		if (vpninfo->ssl_times.rekey_method != REKEY_SSL ||
+		    vpninfo->current_ssl_pkt || vpninfo->ktls_active)
+			goto do_reconnect;
+		if (!cstp_start_rekey(vpninfo))
+			return 1;
+
+	rekey_failed:
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("TLS rehandshake failed; reconnecting\n"));
+		vpninfo->cstp_rekey_start = 0;
 		goto do_reconnect;
-		break;
 
 	case KA_DPD_DEAD:
 	peer_dead:
@@ -891,6 +1589,8 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			     _("CSTP Dead Peer Detection detected dead peer!\n"));
 	do_reconnect:
 		ret = cstp_reconnect(vpninfo);
+		if (ret == -EAGAIN)
+			return 1;
 		if (ret) {
 			vpn_progress(vpninfo, PRG_ERR, _("Reconnect failed\n"));
 			vpninfo->quit_reason = "CSTP reconnect failed";
@@ -909,7 +1609,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	case KA_KEEPALIVE:
 		/* No need to send an explicit keepalive
 		   if we have real data to send */
-		if (vpninfo->dtls_fd == -1 && vpninfo->outgoing_queue)
+		if (vpninfo->dtls_fd == -1 && vpninfo->outgoing_queue.head)
 			break;
 
 		vpn_progress(vpninfo, PRG_TRACE, _("Send CSTP Keepalive\n"));
@@ -921,58 +1621,47 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		;
 	}
 
+	if (vpninfo->deflate)
+		compr_adjust(vpninfo);
+
 	/* Service outgoing packet queue, if no DTLS */
-	while (vpninfo->dtls_fd == -1 && vpninfo->outgoing_queue) {
-		struct pkt *this = vpninfo->outgoing_queue;
-		vpninfo->outgoing_queue = this->next;
-		vpninfo->outgoing_qlen--;
-
-		if (vpninfo->deflate) {
-			unsigned char *adler;
-			int ret;
-
-			vpninfo->deflate_strm.next_in = this->data;
-			vpninfo->deflate_strm.avail_in = this->len;
-			vpninfo->deflate_strm.next_out = (void *)vpninfo->deflate_pkt->data;
-			vpninfo->deflate_strm.avail_out = 2040;
-			vpninfo->deflate_strm.total_out = 0;
-
-			ret = deflate(&vpninfo->deflate_strm, Z_SYNC_FLUSH);
-			if (ret) {
-				vpn_progress(vpninfo, PRG_ERR, _("deflate failed %d\n"), ret);
-				goto uncompr;
+	while (vpninfo->dtls_fd == -1 && vpninfo->outgoing_queue.head) {
+		struct pkt *this = dequeue_packet(&vpninfo->outgoing_queue);
+		struct pkt *batch;
+		unsigned char *hdr;
+
+		/* If there's more than one packet to send, or it needs to be
+		   compressed, build the STF frames in the batch buffer so
+		   that they all go out in a single TLS record. */
+		if ((vpninfo->deflate || vpninfo->outgoing_queue.head) &&
+		    (batch = get_rx_pkt(vpninfo, &vpninfo->cstp_tx_batch,
+					CSTP_TX_BATCH_SIZE))) {
+			while (1) {
+				append_stf_frame(vpninfo, batch, this);
+				queue_packet(&vpninfo->pending_ssl_pkts, this);
+
+				this = vpninfo->outgoing_queue.head;
+				if (!this || batch->len + stf_frame_room(vpninfo, this->len) >
+				    CSTP_TX_BATCH_SIZE)
+					break;
+				dequeue_packet(&vpninfo->outgoing_queue);
 			}
+			if (vpninfo->pending_ssl_pkts.count > 1)
+				vpn_progress(vpninfo, PRG_TRACE,
+					     _("Coalesced %d packets into %d bytes\n"),
+					     vpninfo->pending_ssl_pkts.count, batch->len);
 
-			vpninfo->deflate_pkt->hdr[4] = (vpninfo->deflate_strm.total_out + 4) >> 8;
-			vpninfo->deflate_pkt->hdr[5] = (vpninfo->deflate_strm.total_out + 4) & 0xff;
-
-			/* Add ongoing adler32 to tail of compressed packet */
-			vpninfo->deflate_adler32 = adler32(vpninfo->deflate_adler32,
-							   this->data, this->len);
-
-			adler = &vpninfo->deflate_pkt->data[vpninfo->deflate_strm.total_out];
-			*(adler++) =  vpninfo->deflate_adler32 >> 24;
-			*(adler++) = (vpninfo->deflate_adler32 >> 16) & 0xff;
-			*(adler++) = (vpninfo->deflate_adler32 >> 8) & 0xff;
-			*(adler)   =  vpninfo->deflate_adler32 & 0xff;
-
-			vpninfo->deflate_pkt->len = vpninfo->deflate_strm.total_out + 4;
-
-			vpn_progress(vpninfo, PRG_TRACE,
-				     _("Sending compressed data packet of %d bytes\n"),
-				     this->len);
-
-			vpninfo->pending_deflated_pkt = this;
-			vpninfo->current_ssl_pkt = vpninfo->deflate_pkt;
+			vpninfo->current_ssl_pkt = batch;
 		} else {
-		uncompr:
-			memcpy(this->hdr, data_hdr, 8);
-			this->hdr[4] = this->len >> 8;
-			this->hdr[5] = this->len & 0xff;
+			/* Just the one; send it in place */
+			hdr = pkt_push(this, 8);
+			memcpy(hdr, data_hdr, 8);
+			hdr[4] = (this->len - 8) >> 8;
+			hdr[5] = (this->len - 8) & 0xff;
 
 			vpn_progress(vpninfo, PRG_TRACE,
 				     _("Sending uncompressed data packet of %d bytes\n"),
-				     this->len);
+				     this->len - 8);
 
 			vpninfo->current_ssl_pkt = this;
 		}
@@ -1013,6 +1702,14 @@ int cstp_bye(struct openconnect_info *vpninfo, const char *reason)
 	vpn_progress(vpninfo, PRG_INFO,
 		     _("Send BYE packet: %s\n"), reason);
 
+	/* With kernel TLS, a half-sent packet has to be finished first */
+	if (vpninfo->ktls_tx_sent && vpninfo->current_ssl_pkt &&
+	    cstp_write(vpninfo, vpninfo->current_ssl_pkt->data,
+		       vpninfo->current_ssl_pkt->len) <= 0) {
+		free(bye_pkt);
+		return 0;
+	}
+
 	cstp_write(vpninfo, bye_pkt, reason_len + 9);
 	free(bye_pkt);
 
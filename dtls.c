@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -106,6 +107,259 @@ int RAND_bytes(char *buf, int len)
  * their clients use anyway.
  */
 
+/*
+ * Each DTLS socket has a ring of received datagrams, which is filled by
+ * a single recvmmsg() call where the platform has one. The SSL library
+ * reads them from the ring one at a time, so a burst of small packets
+ * costs one system call rather than one each.
+ *
+ * Likewise, while dtls_mainloop() is draining the outgoing queue, the
+ * records which the SSL library writes are collected and then sent
+ * together by dtls_tx_flush(). At other times they're sent immediately,
+ * as is a record too big for the batch or one that arrives when it's
+ * full, after flushing what's already there so they stay in order.
+ */
+#define DTLS_BATCH		32
+#define DTLS_IO_OVERHEAD	256	/* Record header, IV, MAC, padding */
+
+struct dtls_io {
+	int fd;
+	int slot_size;
+
+	int rx_count;	/* Datagrams in the ring */
+	int rx_next;	/* ... and the next one to hand out */
+	int rx_lens[DTLS_BATCH];
+	unsigned char *rx_bufs;
+
+	int tx_batching;
+	int tx_early;	/* Records which didn't wait for dtls_tx_flush() */
+	int tx_count;
+	int tx_no_gso;	/* UDP_SEGMENT turned out not to work */
+	int tx_lens[DTLS_BATCH];
+	unsigned char *tx_bufs;
+	struct iovec tx_iovs[DTLS_BATCH];
+
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr rx_msgs[DTLS_BATCH];
+	struct iovec rx_iovs[DTLS_BATCH];
+#endif
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr tx_msgs[DTLS_BATCH];
+#endif
+	unsigned char bufs[];
+};
+
+static struct dtls_io *dtls_io_new(struct openconnect_info *vpninfo, int fd)
+{
+	struct dtls_io *io;
+	int slot_size = vpninfo->ip_info.mtu + 1 + DTLS_IO_OVERHEAD;
+	int i;
+
+	if (slot_size < 2048)
+		slot_size = 2048;
+
+	io = calloc(1, sizeof(*io) + 2 * DTLS_BATCH * slot_size);
+	if (!io)
+		return NULL;
+
+	io->fd = fd;
+	io->slot_size = slot_size;
+	io->rx_bufs = io->bufs;
+	io->tx_bufs = io->bufs + DTLS_BATCH * slot_size;
+	for (i = 0; i < DTLS_BATCH; i++) {
+		io->tx_iovs[i].iov_base = io->tx_bufs + i * slot_size;
+#ifdef HAVE_RECVMMSG
+		io->rx_iovs[i].iov_base = io->rx_bufs + i * slot_size;
+		io->rx_iovs[i].iov_len = slot_size;
+		io->rx_msgs[i].msg_hdr.msg_iov = &io->rx_iovs[i];
+		io->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+#ifdef HAVE_SENDMMSG
+		io->tx_msgs[i].msg_hdr.msg_iov = &io->tx_iovs[i];
+		io->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+	}
+	return io;
+}
+
+static void dtls_io_free(struct dtls_io **io)
+{
+	free(*io);
+	*io = NULL;
+}
+
+/* Returns the number of datagrams now in the ring, or -1 with errno set */
+static int dtls_rx_fill(struct dtls_io *io)
+{
+	int i, ret;
+
+	io->rx_count = io->rx_next = 0;
+#ifdef HAVE_RECVMMSG
+	ret = recvmmsg(io->fd, io->rx_msgs, DTLS_BATCH, MSG_DONTWAIT, NULL);
+	if (ret > 0) {
+		for (i = 0; i < ret; i++)
+			io->rx_lens[i] = io->rx_msgs[i].msg_len;
+		io->rx_count = ret;
+		return ret;
+	}
+	if (!ret) {
+		errno = EAGAIN;
+		return -1;
+	}
+	/* Built with it, but the kernel doesn't have it */
+	if (errno != ENOSYS)
+		return -1;
+#endif
+	ret = recv(io->fd, io->rx_bufs, io->slot_size, MSG_DONTWAIT);
+	if (ret < 0)
+		return -1;
+
+	io->rx_lens[0] = ret;
+	io->rx_count = 1;
+	return 1;
+}
+
+/* Copy out the next datagram, receiving another batch if need be. Returns
+   its length, or -1 with errno set (to EAGAIN if there's nothing more). */
+static int dtls_rx_pull(struct dtls_io *io, void *buf, size_t len)
+{
+	int ret;
+
+	do {
+		if (io->rx_next == io->rx_count && dtls_rx_fill(io) < 0)
+			return -1;
+		/* An empty datagram would look like EOF to the SSL library */
+		ret = io->rx_lens[io->rx_next++];
+	} while (!ret);
+
+	if ((size_t)ret > len)
+		ret = len;
+	memcpy(buf, io->rx_bufs + (io->rx_next - 1) * io->slot_size, ret);
+	return ret;
+}
+
+#if defined(__linux__) && !defined(UDP_SEGMENT)
+#define UDP_SEGMENT 103
+#endif
+
+#ifdef UDP_SEGMENT
+/* If the records are all the same size (bar the last, which may be
+   shorter), the kernel can split them up from a single send. */
+static int dtls_tx_send_gso(struct dtls_io *io)
+{
+	char cmsgbuf[CMSG_SPACE(sizeof(uint16_t))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	uint16_t gso_size = io->tx_lens[0];
+	int i, total = 0;
+
+	for (i = 0; i < io->tx_count; i++) {
+		if (io->tx_lens[i] > gso_size ||
+		    (io->tx_lens[i] < gso_size && i < io->tx_count - 1))
+			return 0;
+		total += io->tx_lens[i];
+	}
+	if (total > 65000)
+		return 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = io->tx_iovs;
+	msg.msg_iovlen = io->tx_count;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = IPPROTO_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+	memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+
+	if (sendmsg(io->fd, &msg, 0) >= 0)
+		return io->tx_count;
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		return -1;
+
+	/* Not supported by the kernel or the device; don't try again.
+	   Anything else (a queued ICMP error, ENOBUFS) may be transient,
+	   so just let sendmmsg() have a go this time. */
+	if (errno == EINVAL || errno == EOPNOTSUPP ||
+	    errno == ENOPROTOOPT || errno == EIO)
+		io->tx_no_gso = 1;
+	return 0;
+}
+#endif
+
+/* Send the records collected since tx_batching was set. Returns how many
+   were sent; if that's not all of them, errno says why not. */
+static int dtls_tx_flush(struct dtls_io *io)
+{
+	int i, ret, sent = 0;
+
+	if (!io->tx_count)
+		return 0;
+
+	for (i = 0; i < io->tx_count; i++)
+		io->tx_iovs[i].iov_len = io->tx_lens[i];
+
+#ifdef UDP_SEGMENT
+	if (io->tx_count > 1 && !io->tx_no_gso) {
+		ret = dtls_tx_send_gso(io);
+		if (ret) {
+			sent = ret > 0 ? ret : 0;
+			goto out;
+		}
+	}
+#endif
+#ifdef HAVE_SENDMMSG
+	ret = sendmmsg(io->fd, io->tx_msgs, io->tx_count, 0);
+	if (ret >= 0) {
+		sent = ret;
+		/* It stops at the first one that wouldn't go */
+		if (sent < io->tx_count)
+			errno = EAGAIN;
+		goto out;
+	}
+	if (errno != ENOSYS)
+		goto out;
+#endif
+	while (sent < io->tx_count &&
+	       send(io->fd, io->tx_iovs[sent].iov_base, io->tx_lens[sent], 0) >= 0)
+		sent++;
+ out:
+	io->tx_count = 0;
+	return sent;
+}
+
+/* The SSL library's output. Returns len, or -1 with errno set. A record
+   which can't join the batch flushes it first, to keep them in order. */
+static int dtls_tx_push(struct dtls_io *io, const void *buf, size_t len)
+{
+	int ret;
+
+	if (!io->tx_batching)
+		return send(io->fd, buf, len, 0);
+
+	if (io->tx_count == DTLS_BATCH || len > (size_t)io->slot_size) {
+		/* The SSL library thinks they've gone already, so any
+		   that don't are just lost, like any other datagram */
+		io->tx_early += io->tx_count;
+		dtls_tx_flush(io);
+
+		ret = send(io->fd, buf, len, 0);
+		if (ret >= 0)
+			io->tx_early++;
+		return ret;
+	}
+
+	memcpy(io->tx_bufs + io->tx_count * io->slot_size, buf, len);
+	io->tx_lens[io->tx_count++] = len;
+	return len;
+}
+
+static void dtls_handshake_done(struct openconnect_info *vpninfo);
+static void dtls_handshake_failed(struct openconnect_info *vpninfo);
+
 #if defined(DTLS_OPENSSL)
 #define DTLS_SEND SSL_write
 #define DTLS_RECV SSL_read
@@ -117,6 +371,83 @@ int RAND_bytes(char *buf, int len)
 extern void dtls1_stop_timer(SSL *);
 #endif
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define BIO_get_data(b) ((b)->ptr)
+#define BIO_set_data(b, p) ((b)->ptr = (p))
+#define BIO_set_init(b, i) ((b)->init = (i))
+#endif
+
+/* A BIO which reads and writes through the socket's struct dtls_io */
+static int dtls_bio_read(BIO *b, char *buf, int len)
+{
+	struct dtls_io *io = BIO_get_data(b);
+	int ret = dtls_rx_pull(io, buf, len);
+
+	BIO_clear_retry_flags(b);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		BIO_set_retry_read(b);
+	return ret;
+}
+
+static int dtls_bio_write(BIO *b, const char *buf, int len)
+{
+	struct dtls_io *io = BIO_get_data(b);
+	int ret = dtls_tx_push(io, buf, len);
+
+	BIO_clear_retry_flags(b);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		BIO_set_retry_write(b);
+	return ret;
+}
+
+static long dtls_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+	return cmd == BIO_CTRL_FLUSH;
+}
+
+static int dtls_bio_create(BIO *b)
+{
+	BIO_set_init(b, 1);
+	return 1;
+}
+
+static BIO *dtls_bio_new(struct dtls_io *io)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	static BIO_METHOD *meth;
+	BIO *b;
+
+	if (!meth) {
+		meth = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+				    "openconnect DTLS");
+		if (!meth)
+			return NULL;
+		BIO_meth_set_write(meth, dtls_bio_write);
+		BIO_meth_set_read(meth, dtls_bio_read);
+		BIO_meth_set_ctrl(meth, dtls_bio_ctrl);
+		BIO_meth_set_create(meth, dtls_bio_create);
+	}
+	b = BIO_new(meth);
+#else
+	static BIO_METHOD meth = {
+		BIO_TYPE_SOURCE_SINK,
+		"openconnect DTLS",
+		dtls_bio_write,
+		dtls_bio_read,
+		NULL,
+		NULL,
+		dtls_bio_ctrl,
+		dtls_bio_create,
+		NULL,
+		NULL,
+	};
+	BIO *b = BIO_new(&meth);
+#endif
+	if (b)
+		BIO_set_data(b, io);
+	return b;
+}
+
 static int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 {
 	STACK_OF(SSL_CIPHER) *ciphers;
@@ -203,9 +534,12 @@ static int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 		return -EINVAL;
 	}
 
-	dtls_bio = BIO_new_socket(dtls_fd, BIO_NOCLOSE);
-	/* Set non-blocking */
-	BIO_set_nbio(dtls_bio, 1);
+	dtls_bio = dtls_bio_new(vpninfo->new_dtls_io);
+	if (!dtls_bio) {
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to create DTLS BIO\n"));
+		SSL_free(dtls_ssl);
+		return -ENOMEM;
+	}
 	SSL_set_bio(dtls_ssl, dtls_bio, dtls_bio);
 
 	SSL_set_options(dtls_ssl, SSL_OP_CISCO_ANYCONNECT);
@@ -222,14 +556,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	if (ret == 1) {
 		vpn_progress(vpninfo, PRG_INFO, _("Established DTLS connection (using OpenSSL)\n"));
 
-		dtls_close(vpninfo, 0);
-		vpninfo->dtls_ssl = vpninfo->new_dtls_ssl;
-		vpninfo->dtls_fd = vpninfo->new_dtls_fd;
-
-		vpninfo->new_dtls_ssl = NULL;
-		vpninfo->new_dtls_fd = -1;
-
-		vpninfo->dtls_times.last_rx = vpninfo->dtls_times.last_tx = time(NULL);
+		dtls_handshake_done(vpninfo);
 
 		/* From about 8.4.1(11) onwards, the ASA seems to get
 		   very unhappy if we resend ChangeCipherSpec messages
@@ -294,7 +621,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	ret = SSL_get_error(vpninfo->new_dtls_ssl, ret);
 	if (ret == SSL_ERROR_WANT_WRITE || ret == SSL_ERROR_WANT_READ) {
 		static int badossl_bitched = 0;
-		if (time(NULL) < vpninfo->new_dtls_started + 5)
+		if (vpn_time_ms() < vpninfo->new_dtls_started + DTLS_HANDSHAKE_TIMEOUT)
 			return 0;
 		if (((OPENSSL_VERSION_NUMBER >= 0x100000b0L && OPENSSL_VERSION_NUMBER <= 0x100000c0L) || \
 		     (OPENSSL_VERSION_NUMBER >= 0x10001040L && OPENSSL_VERSION_NUMBER <= 0x10001060L) || \
@@ -311,12 +638,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	vpn_progress(vpninfo, PRG_ERR, _("DTLS handshake failed: %d\n"), ret);
 	openconnect_report_ssl_errors(vpninfo);
 
-	/* Kill both the new (failed) connection and the old one too. The
-	   only time there'll be a valid existing session is when it was a
-	   rekey, and in that case it's time for the old one to die. */
-	dtls_close(vpninfo, 1);
-
-	time(&vpninfo->new_dtls_started);
+	dtls_handshake_failed(vpninfo);
 	return -EINVAL;
 }
 
@@ -340,6 +662,30 @@ struct {
 #define DTLS_SEND gnutls_record_send
 #define DTLS_RECV gnutls_record_recv
 #define DTLS_FREE gnutls_deinit
+
+static ssize_t dtls_pull(gnutls_transport_ptr_t ptr, void *buf, size_t len)
+{
+	return dtls_rx_pull(ptr, buf, len);
+}
+
+static ssize_t dtls_push(gnutls_transport_ptr_t ptr, const void *buf, size_t len)
+{
+	return dtls_tx_push(ptr, buf, len);
+}
+
+static int dtls_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms)
+{
+	struct dtls_io *io = ptr;
+	struct pollfd pfd;
+
+	if (io->rx_next < io->rx_count)
+		return 1;
+
+	pfd.fd = io->fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, ms == GNUTLS_INDEFINITE_TIMEOUT ? -1 : (int)ms);
+}
+
 static int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 {
 	gnutls_session_t dtls_ssl;
@@ -370,8 +716,10 @@ static int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 		vpninfo->dtls_attempt_period = 0;
 		return -EINVAL;
 	}
-	gnutls_transport_set_ptr(dtls_ssl,
-				 (gnutls_transport_ptr_t)(long) dtls_fd);
+	gnutls_transport_set_ptr(dtls_ssl, vpninfo->new_dtls_io);
+	gnutls_transport_set_push_function(dtls_ssl, dtls_push);
+	gnutls_transport_set_pull_function(dtls_ssl, dtls_pull);
+	gnutls_transport_set_pull_timeout_function(dtls_ssl, dtls_pull_timeout);
 	gnutls_record_disable_padding(dtls_ssl);
 	master_secret.data = vpninfo->dtls_secret;
 	master_secret.size = sizeof(vpninfo->dtls_secret);
@@ -424,21 +772,14 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 
 		vpn_progress(vpninfo, PRG_INFO, _("Established DTLS connection (using GnuTLS)\n"));
 
-		dtls_close(vpninfo, 0);
-		vpninfo->dtls_ssl = vpninfo->new_dtls_ssl;
-		vpninfo->dtls_fd = vpninfo->new_dtls_fd;
-
-		vpninfo->new_dtls_ssl = NULL;
-		vpninfo->new_dtls_fd = -1;
-
-		vpninfo->dtls_times.last_rx = vpninfo->dtls_times.last_tx = time(NULL);
+		dtls_handshake_done(vpninfo);
 
 		/* XXX: For OpenSSL we explicitly prevent retransmits here. */
 		return 0;
 	}
 
 	if (err == GNUTLS_E_AGAIN) {
-		if (time(NULL) < vpninfo->new_dtls_started + 5)
+		if (vpn_time_ms() < vpninfo->new_dtls_started + DTLS_HANDSHAKE_TIMEOUT)
 			return 0;
 		vpn_progress(vpninfo, PRG_TRACE, _("DTLS handshake timed out\n"));
 	}
@@ -447,16 +788,225 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 		     gnutls_strerror(err));
 
  error:
-	/* Kill both the new (failed) connection and the old one too. The
-	   only time there'll be a valid existing session is when it was a
-	   rekey, and in that case it's time for the old one to die. */
-	dtls_close(vpninfo, 1);
-
-	time(&vpninfo->new_dtls_started);
+	dtls_handshake_failed(vpninfo);
 	return -EINVAL;
 }
 #endif
 
+/* Worst case DTLS record overhead: header, SHA1 MAC, AES IV, padding */
+#define DTLS_MAX_OVERHEAD (13 + 20 + 16 + 16)
+
+/* Probes are sent with DF set and without fragmenting them, so that one
+   too big for the path just gets lost. Everything else is left to the
+   kernel's usual path MTU discovery, which will still fragment if the
+   tun device's MTU is too big or isn't ours to change. */
+static void dtls_set_pmtudisc(struct openconnect_info *vpninfo, int fd, int probing)
+{
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+	if (vpninfo->peer_addr->sa_family == AF_INET) {
+		int val = probing ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+		setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+	}
+#endif
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+	if (vpninfo->peer_addr->sa_family == AF_INET6) {
+		int val = probing ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val, sizeof(val));
+	}
+#endif
+}
+
+/* The tunnel MTU which would fit in the path MTU the kernel has learned
+   from ICMP, or zero if we can't ask it. */
+static int dtls_kernel_pmtu(struct openconnect_info *vpninfo)
+{
+#ifdef __linux__
+	int mtu;
+	socklen_t mtu_size = sizeof(mtu);
+
+	if (vpninfo->peer_addr->sa_family == AF_INET &&
+	    !getsockopt(vpninfo->dtls_fd, IPPROTO_IP, IP_MTU, &mtu, &mtu_size))
+		return mtu - 20 - 8 - DTLS_MAX_OVERHEAD - 1;
+	if (vpninfo->peer_addr->sa_family == AF_INET6 &&
+	    !getsockopt(vpninfo->dtls_fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &mtu_size))
+		return mtu - 40 - 8 - DTLS_MAX_OVERHEAD - 1;
+#endif
+	return 0;
+}
+
+static int dtls_pmtu_floor(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->ip_info.mtu < DTLS_PMTU_BASE)
+		return vpninfo->ip_info.mtu;
+	return DTLS_PMTU_BASE;
+}
+
+static int dtls_pmtu_midpoint(struct pmtu_info *p)
+{
+	if (p->hi - p->lo < DTLS_PMTU_STEP)
+		return 0;
+	return (p->lo + p->hi + 1) / 2;
+}
+
+/* Search between lo, which works, and hi. If we don't know of anything
+   which works, try hi first and then the floor. */
+static void dtls_pmtu_start(struct openconnect_info *vpninfo, int lo, int hi)
+{
+	struct pmtu_info *p = &vpninfo->dtls_pmtu;
+
+	p->lo = lo;
+	p->hi = hi;
+	p->next = lo ? dtls_pmtu_midpoint(p) : hi;
+	p->probe = 0;
+	p->tries = 0;
+	p->next_search = 0;
+}
+
+/* Use a new MTU for the tun device. The DTLS session itself keeps the
+   MTU it was set up with, so that packets which were already queued at
+   the old size and probes bigger than the new one can still be sent. */
+static void dtls_pmtu_set(struct openconnect_info *vpninfo, int mtu)
+{
+	struct pmtu_info *p = &vpninfo->dtls_pmtu;
+	int old_mtu = p->mtu ? p->mtu : vpninfo->ip_info.mtu;
+
+	p->mtu = mtu;
+	vpninfo->stats.dtls_pmtu = mtu;
+	if (mtu == old_mtu)
+		return;
+
+	/* If someone else set up the tun device, it's theirs to change */
+	if (vpninfo->tun_fd == -1 || !vpninfo->ifname || vpninfo->script_tun) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("DTLS path MTU is %d\n"), mtu);
+		return;
+	}
+
+	vpn_progress(vpninfo, PRG_INFO,
+		     _("DTLS path MTU is %d; changing tunnel MTU from %d\n"),
+		     mtu, old_mtu);
+	set_tun_mtu(vpninfo, mtu);
+}
+
+static void dtls_pmtu_result(struct openconnect_info *vpninfo, int ok)
+{
+	struct pmtu_info *p = &vpninfo->dtls_pmtu;
+	int floor = dtls_pmtu_floor(vpninfo);
+	int size = p->probe;
+
+	p->probe = 0;
+	p->tries = 0;
+
+	if (ok) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("DTLS MTU probe of %d bytes succeeded\n"), size);
+		p->lo = size;
+		dtls_pmtu_set(vpninfo, size);
+		p->next = dtls_pmtu_midpoint(p);
+	} else if (!p->lo && size <= floor) {
+		/* Most likely the server doesn't echo the padding back */
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("DTLS MTU probes not answered; not probing\n"));
+		p->next = 0;
+		return;
+	} else {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("DTLS MTU probe of %d bytes failed\n"), size);
+		p->hi = size - 1;
+		p->next = p->lo ? dtls_pmtu_midpoint(p) : floor;
+	}
+
+	if (!p->next && p->mtu + DTLS_PMTU_STEP <= vpninfo->ip_info.mtu)
+		p->next_search = vpninfo->now + DTLS_PMTU_RAISE;
+}
+
+static void dtls_pmtu_send_probe(struct openconnect_info *vpninfo)
+{
+	struct pmtu_info *p = &vpninfo->dtls_pmtu;
+	struct pkt *pkt = alloc_pkt(vpninfo, p->probe);
+	unsigned char *buf;
+
+	if (!pkt)
+		return;
+
+	buf = pkt_push(pkt, 1);
+	memset(buf, 0, p->probe + 1);
+	buf[0] = AC_PKT_DPD_OUT;
+
+	vpn_progress(vpninfo, PRG_TRACE, _("Send DTLS MTU probe of %d bytes\n"),
+		     p->probe);
+	/* Nothing is being batched now, so this goes straight out */
+	dtls_set_pmtudisc(vpninfo, vpninfo->dtls_fd, 1);
+	if (DTLS_SEND(vpninfo->dtls_ssl, buf, p->probe + 1) == p->probe + 1) {
+		/* It only stands in for a keepalive if it went out */
+		vpninfo->stats.dtls_pmtu_probes++;
+		vpninfo->dtls_times.last_tx = vpninfo->now;
+	} else
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Failed to send DTLS MTU probe\n"));
+	dtls_set_pmtudisc(vpninfo, vpninfo->dtls_fd, 0);
+	free_pkt(vpninfo, pkt);
+}
+
+/* Probe the path MTU with DPD requests padded out to the size in
+   question; the server sends them back whole as DPD responses, so
+   dtls_mainloop() calls dtls_pmtu_result() when one of those comes
+   back big enough. Probes which fail are retried DTLS_PMTU_TRIES times
+   before we believe it. */
+static void dtls_pmtu_run(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct pmtu_info *p = &vpninfo->dtls_pmtu;
+
+	/* If ICMP tells the kernel the path has shrunk, start again */
+	if (p->lo && vpninfo->now >= p->last_check + DTLS_PMTU_CHECK) {
+		int kmtu = dtls_kernel_pmtu(vpninfo);
+		int floor = dtls_pmtu_floor(vpninfo);
+
+		p->last_check = vpninfo->now;
+		if (kmtu && kmtu < p->kernel_mtu && kmtu < p->mtu) {
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("Path MTU for DTLS fell to %d; probing again\n"),
+				     kmtu);
+			dtls_pmtu_start(vpninfo, 0, kmtu < floor ? floor : kmtu);
+		}
+		if (kmtu)
+			p->kernel_mtu = kmtu;
+	}
+
+	if (!p->probe && !p->next) {
+		if (!p->next_search)
+			return;
+		if (vpninfo->now < p->next_search) {
+			set_deadline(timeout, p->next_search, vpninfo->now);
+			return;
+		}
+		/* See if it's got any bigger */
+		dtls_pmtu_start(vpninfo, p->mtu, vpninfo->ip_info.mtu);
+	}
+
+	if (p->probe) {
+		if (vpninfo->now < p->probe_sent + DTLS_PMTU_TIMEOUT) {
+			set_deadline(timeout, p->probe_sent + DTLS_PMTU_TIMEOUT,
+				     vpninfo->now);
+			return;
+		}
+		if (p->tries >= DTLS_PMTU_TRIES)
+			dtls_pmtu_result(vpninfo, 0);
+	}
+
+	if (!p->probe) {
+		if (!p->next)
+			return;
+		p->probe = p->next;
+		p->next = 0;
+	}
+
+	dtls_pmtu_send_probe(vpninfo);
+	p->tries++;
+	p->probe_sent = vpninfo->now;
+	set_deadline(timeout, p->probe_sent + DTLS_PMTU_TIMEOUT, vpninfo->now);
+}
+
 int connect_dtls_socket(struct openconnect_info *vpninfo)
 {
 	int dtls_fd, ret, sndbuf;
@@ -537,48 +1087,123 @@ int connect_dtls_socket(struct openconnect_info *vpninfo)
 	fcntl(dtls_fd, F_SETFD, FD_CLOEXEC);
 	fcntl(dtls_fd, F_SETFL, fcntl(dtls_fd, F_GETFL) | O_NONBLOCK);
 
+	vpninfo->new_dtls_io = dtls_io_new(vpninfo, dtls_fd);
+	if (!vpninfo->new_dtls_io) {
+		close(dtls_fd);
+		return -ENOMEM;
+	}
+
 	ret = start_dtls_handshake(vpninfo, dtls_fd);
 	if (ret) {
+		dtls_io_free(&vpninfo->new_dtls_io);
 		close(dtls_fd);
 		return ret;
 	}
 
 	vpninfo->new_dtls_fd = dtls_fd;
-	if (vpninfo->select_nfds <= dtls_fd)
-		vpninfo->select_nfds = dtls_fd + 1;
+	monitor_fd_events(vpninfo, dtls_fd, FD_EV_READ | FD_EV_EXCEPT, 0);
 
-	FD_SET(dtls_fd, &vpninfo->select_rfds);
-	FD_SET(dtls_fd, &vpninfo->select_efds);
-
-	time(&vpninfo->new_dtls_started);
+	vpninfo->new_dtls_started = vpn_time_ms();
+	vpninfo->stats.dtls_connect_attempts++;
 
 	return dtls_try_handshake(vpninfo);
 }
 
+static void dtls_close_new(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->new_dtls_ssl) {
+		DTLS_FREE(vpninfo->new_dtls_ssl);
+		unmonitor_fd(vpninfo, vpninfo->new_dtls_fd);
+		close(vpninfo->new_dtls_fd);
+		dtls_io_free(&vpninfo->new_dtls_io);
+		vpninfo->new_dtls_ssl = NULL;
+		vpninfo->new_dtls_fd = -1;
+	}
+}
+
 void dtls_close(struct openconnect_info *vpninfo, int kill_handshake_too)
 {
 	if (vpninfo->dtls_ssl) {
 		DTLS_FREE(vpninfo->dtls_ssl);
+		unmonitor_fd(vpninfo, vpninfo->dtls_fd);
 		close(vpninfo->dtls_fd);
-		FD_CLR(vpninfo->dtls_fd, &vpninfo->select_rfds);
-		FD_CLR(vpninfo->dtls_fd, &vpninfo->select_wfds);
-		FD_CLR(vpninfo->dtls_fd, &vpninfo->select_efds);
+		dtls_io_free(&vpninfo->dtls_io);
 		vpninfo->dtls_ssl = NULL;
 		vpninfo->dtls_fd = -1;
 	}
-	if (kill_handshake_too && vpninfo->new_dtls_ssl) {
-		DTLS_FREE(vpninfo->new_dtls_ssl);
-		close(vpninfo->new_dtls_fd);
-		FD_CLR(vpninfo->new_dtls_fd, &vpninfo->select_rfds);
-		FD_CLR(vpninfo->new_dtls_fd, &vpninfo->select_efds);
-		vpninfo->new_dtls_ssl = NULL;
-		vpninfo->new_dtls_fd = -1;
-	}
+	if (kill_handshake_too)
+		dtls_close_new(vpninfo);
 }
 
-static int dtls_restart(struct openconnect_info *vpninfo)
+/* The new session is up. If there was an old one, it has been carrying
+   the traffic until now; this is where we switch over to the new one. */
+static void dtls_handshake_done(struct openconnect_info *vpninfo)
 {
+	uint64_t now = vpn_time_ms();
+
+	if (vpninfo->dtls_ssl) {
+		vpninfo->stats.dtls_switchovers++;
+		vpninfo->stats.dtls_switchover_ms = now - vpninfo->new_dtls_started;
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Switched to new DTLS session after %lu ms\n"),
+			     (unsigned long)vpninfo->stats.dtls_switchover_ms);
+	}
+
 	dtls_close(vpninfo, 0);
+	vpninfo->dtls_ssl = vpninfo->new_dtls_ssl;
+	vpninfo->dtls_fd = vpninfo->new_dtls_fd;
+	vpninfo->dtls_io = vpninfo->new_dtls_io;
+
+	vpninfo->new_dtls_ssl = NULL;
+	vpninfo->new_dtls_fd = -1;
+	vpninfo->new_dtls_io = NULL;
+
+	vpninfo->dtls_times.last_rx = vpninfo->dtls_times.last_tx = now;
+
+	/* It may be a different path now */
+	vpninfo->dtls_pmtu.kernel_mtu = 0;
+	dtls_pmtu_start(vpninfo, 0, vpninfo->ip_info.mtu);
+}
+
+static void dtls_handshake_failed(struct openconnect_info *vpninfo)
+{
+	vpninfo->stats.dtls_connect_failures++;
+
+	if (!vpninfo->dtls_ssl) {
+		dtls_close(vpninfo, 1);
+	} else if (vpninfo->dtls_times.rekey_method == REKEY_SSL &&
+		   !vpninfo->dtls_rekey_tunnel) {
+		/* It was a rekey in the background. The old session still
+		   works, so keep using it while we do it the hard way. */
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("DTLS rekey failed; reconnecting\n"));
+		dtls_close_new(vpninfo);
+		vpninfo->dtls_rekey_tunnel = 1;
+		vpninfo->dtls_times.last_rekey = 0;
+	} else {
+		/* A replacement after a new tunnel. The old session is still
+		   passing traffic; if the server has forgotten it, DPD will
+		   notice and we'll try again from scratch. */
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to replace DTLS session; keeping the old one\n"));
+		dtls_close_new(vpninfo);
+	}
+
+	vpninfo->new_dtls_started = vpn_time_ms();
+}
+
+/* Start a new DTLS session to replace the current one. Unless it's
+   already dead, the old session keeps carrying traffic until the new
+   one has finished its handshake; if it is, the traffic goes over CSTP
+   in the meantime. */
+static int dtls_restart(struct openconnect_info *vpninfo, int old_is_dead)
+{
+	if (old_is_dead) {
+		vpninfo->stats.dtls_cstp_fallbacks++;
+		dtls_close(vpninfo, 1);
+	} else
+		dtls_close_new(vpninfo);
+
 	return connect_dtls_socket(vpninfo);
 }
 
@@ -658,43 +1283,79 @@ int openconnect_setup_dtls(struct openconnect_info *vpninfo, int dtls_attempt_pe
 	return 0;
 }
 
-static struct pkt *dtls_pkt;
-static int dtls_pkt_max;
+/* Send the records written for the packets in 'batch'; recs[i] is how
+   many had been written once packet i was. Free the packets which made
+   it, and put the rest back at the head of the queue. Returns 0 if they
+   all went, 1 if the socket is full, or -1 if DTLS must be restarted. */
+static int dtls_flush_batch(struct openconnect_info *vpninfo,
+			    struct pkt_queue *batch, int *recs)
+{
+	struct dtls_io *io = vpninfo->dtls_io;
+	int sent = io->tx_early + dtls_tx_flush(io);
+	int err = errno;
+	int i = 0;
+
+	io->tx_early = 0;
+
+	while (batch->head && recs[i] <= sent) {
+		struct pkt *this = dequeue_packet(batch);
+
+		tx_pkt_sent(vpninfo, this);
+		free_pkt(vpninfo, this);
+		i++;
+	}
+	if (!batch->head)
+		return 0;
+
+	requeue_packets(&vpninfo->outgoing_queue, batch);
+	if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR) {
+		monitor_write_fd(vpninfo, vpninfo->dtls_fd);
+		return 1;
+	}
+
+	vpn_progress(vpninfo, PRG_ERR,
+		     _("DTLS got write error: %s. Falling back to SSL\n"),
+		     strerror(err));
+	return -1;
+}
 
 int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
+	struct pkt_queue batch = { NULL, NULL, 0, 0 };
+	int recs[DTLS_BATCH];
 	int work_done = 0;
+	int ret;
 	char magic_pkt;
 
 	while (1) {
 		int len = vpninfo->ip_info.mtu;
+		struct pkt *pkt;
 		unsigned char *buf;
 
-		if (!dtls_pkt || len > dtls_pkt_max) {
-			realloc_inplace(dtls_pkt, sizeof(struct pkt) + len);
-			if (!dtls_pkt) {
-				vpn_progress(vpninfo, PRG_ERR, "Allocation failed\n");
-				break;
-			}
-			dtls_pkt_max = len;
+		pkt = get_rx_pkt(vpninfo, &vpninfo->dtls_pkt, len);
+		if (!pkt) {
+			vpn_progress(vpninfo, PRG_ERR, "Allocation failed\n");
+			break;
 		}
 
-		buf = dtls_pkt->data - 1;
+		/* One byte of header */
+		buf = pkt_push(pkt, 1);
 		len = DTLS_RECV(vpninfo->dtls_ssl, buf, len + 1);
 		if (len <= 0)
 			break;
+		pkt->len = len;
+		pkt_pull(pkt, 1);
 
 		vpn_progress(vpninfo, PRG_TRACE,
 			     _("Received DTLS packet 0x%02x of %d bytes\n"),
 			     buf[0], len);
 
-		vpninfo->dtls_times.last_rx = time(NULL);
+		vpninfo->dtls_times.last_rx = vpninfo->now;
 
 		switch (buf[0]) {
 		case AC_PKT_DATA:
-			dtls_pkt->len = len - 1;
-			queue_packet(&vpninfo->incoming_queue, dtls_pkt);
-			dtls_pkt = NULL;
+			queue_packet(&vpninfo->incoming_queue, pkt);
+			vpninfo->dtls_pkt = NULL;
 			work_done = 1;
 			break;
 
@@ -710,6 +1371,9 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 
 		case AC_PKT_DPD_RESP:
 			vpn_progress(vpninfo, PRG_TRACE, _("Got DTLS DPD response\n"));
+			/* An MTU probe, if it came back whole */
+			if (vpninfo->dtls_pmtu.probe && len > vpninfo->dtls_pmtu.probe)
+				dtls_pmtu_result(vpninfo, 1);
 			break;
 
 		case AC_PKT_KEEPALIVE:
@@ -735,22 +1399,46 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		}
 	}
 
-	switch (keepalive_action(&vpninfo->dtls_times, timeout)) {
+	switch (keepalive_action(&vpninfo->dtls_times, vpninfo->now, timeout)) {
 	case KA_REKEY: {
-		int ret;
-
 		vpn_progress(vpninfo, PRG_INFO, _("DTLS rekey due\n"));
+		vpninfo->dtls_times.last_rekey = vpninfo->now;
+
+		/* Resuming the session again, from a new socket, gives us new
+		   keys without having to touch CSTP. Traffic carries on over
+		   the old session until the handshake is done, and then
+		   dtls_try_handshake() switches over to the new one. */
+		if (vpninfo->dtls_times.rekey_method == REKEY_SSL &&
+		    !vpninfo->dtls_rekey_tunnel) {
+			if (vpninfo->new_dtls_ssl)
+				break;
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Starting new DTLS session in the background\n"));
+			if (dtls_restart(vpninfo, 0)) {
+				/* Do it the hard way next time round */
+				vpninfo->dtls_rekey_tunnel = 1;
+				vpninfo->dtls_times.last_rekey = 0;
+			}
+			return 1;
+		}
 
-		/* There ought to be a method of rekeying DTLS without tearing down
-		   the CSTP session and restarting, but we don't (yet) know it */
+		/* Otherwise it takes a whole new tunnel */
 		ret = cstp_reconnect(vpninfo);
+		if (ret == -EAGAIN) {
+			/* It'll be done outside the group. Start DTLS
+			   afresh as soon as CSTP is back. */
+			dtls_close(vpninfo, 1);
+			vpninfo->new_dtls_started = 0;
+			return 1;
+		}
 		if (ret) {
 			vpn_progress(vpninfo, PRG_ERR, _("Reconnect failed\n"));
 			vpninfo->quit_reason = "CSTP reconnect failed";
 			return ret;
 		}
 
-		if (dtls_restart(vpninfo))
+		/* The old DTLS session carries on until the new one is ready */
+		if (dtls_restart(vpninfo, 0))
 			vpn_progress(vpninfo, PRG_ERR, _("DTLS rekey failed\n"));
 		return 1;
 	}
@@ -758,7 +1446,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	case KA_DPD_DEAD:
 		vpn_progress(vpninfo, PRG_ERR, _("DTLS Dead Peer Detection detected dead peer!\n"));
 		/* Fall back to SSL, and start a new DTLS connection */
-		dtls_restart(vpninfo);
+		dtls_restart(vpninfo, 1);
 		return 1;
 
 	case KA_DPD:
@@ -777,7 +1465,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 	case KA_KEEPALIVE:
 		/* No need to send an explicit keepalive
 		   if we have real data to send */
-		if (vpninfo->outgoing_queue)
+		if (vpninfo->outgoing_queue.head)
 			break;
 
 		vpn_progress(vpninfo, PRG_TRACE, _("Send DTLS Keepalive\n"));
@@ -786,7 +1474,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		if (DTLS_SEND(vpninfo->dtls_ssl, &magic_pkt, 1) != 1)
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to send keepalive request. Expect disconnect\n"));
-		time(&vpninfo->dtls_times.last_tx);
+		vpninfo->dtls_times.last_tx = vpninfo->now;
 		work_done = 1;
 		break;
 
@@ -794,69 +1482,86 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		;
 	}
 
-	/* Service outgoing packet queue */
-	FD_CLR(vpninfo->dtls_fd, &vpninfo->select_wfds);
-	while (vpninfo->outgoing_queue) {
-		struct pkt *this = vpninfo->outgoing_queue;
-		int ret;
+	dtls_pmtu_run(vpninfo, timeout);
+
+	/* Service outgoing packet queue. The records are sent together when
+	   it's empty, or when there are DTLS_BATCH of them. */
+	unmonitor_write_fd(vpninfo, vpninfo->dtls_fd);
+	vpninfo->dtls_io->tx_batching = 1;
+	while (vpninfo->outgoing_queue.head) {
+		struct pkt *this;
+
+		if (batch.count == DTLS_BATCH ||
+		    vpninfo->dtls_io->tx_count == DTLS_BATCH) {
+			ret = dtls_flush_batch(vpninfo, &batch, recs);
+			if (ret)
+				goto out;
+		}
 
-		vpninfo->outgoing_queue = this->next;
-		vpninfo->outgoing_qlen--;
+		this = dequeue_packet(&vpninfo->outgoing_queue);
 
 		/* One byte of header */
-		this->hdr[7] = AC_PKT_DATA;
+		*pkt_push(this, 1) = AC_PKT_DATA;
 
 #if defined(DTLS_OPENSSL)
-		ret = SSL_write(vpninfo->dtls_ssl, &this->hdr[7], this->len + 1);
+		ret = SSL_write(vpninfo->dtls_ssl, this->data, this->len);
+		pkt_pull(this, 1);
 		if (ret <= 0) {
 			ret = SSL_get_error(vpninfo->dtls_ssl, ret);
 
 			if (ret == SSL_ERROR_WANT_WRITE) {
-				FD_SET(vpninfo->dtls_fd, &vpninfo->select_wfds);
-				vpninfo->outgoing_queue = this;
-				vpninfo->outgoing_qlen++;
+				monitor_write_fd(vpninfo, vpninfo->dtls_fd);
+				requeue_packet(&vpninfo->outgoing_queue, this);
 
 			} else if (ret != SSL_ERROR_WANT_READ) {
 				/* If it's a real error, kill the DTLS connection and
-				   requeue the packet to be sent over SSL */
+				   requeue the packets to be sent over SSL */
 				vpn_progress(vpninfo, PRG_ERR,
 					     _("DTLS got write error %d. Falling back to SSL\n"),
 					     ret);
 				openconnect_report_ssl_errors(vpninfo);
-				dtls_restart(vpninfo);
-				vpninfo->outgoing_queue = this;
-				vpninfo->outgoing_qlen++;
-				work_done = 1;
+				requeue_packet(&vpninfo->outgoing_queue, this);
+				requeue_packets(&vpninfo->outgoing_queue, &batch);
+				dtls_restart(vpninfo, 1);
+				return 1;
 			}
-			return work_done;
+			break;
 		}
 #elif defined(DTLS_GNUTLS)
-		ret = gnutls_record_send(vpninfo->dtls_ssl, &this->hdr[7], this->len + 1);
+		ret = gnutls_record_send(vpninfo->dtls_ssl, this->data, this->len);
+		pkt_pull(this, 1);
 		if (ret <= 0) {
 			if (ret != GNUTLS_E_AGAIN) {
 				vpn_progress(vpninfo, PRG_ERR,
 					     _("DTLS got write error: %s. Falling back to SSL\n"),
 					     gnutls_strerror(ret));
-				dtls_restart(vpninfo);
-				vpninfo->outgoing_queue = this;
-				vpninfo->outgoing_qlen++;
-				work_done = 1;
+				requeue_packet(&vpninfo->outgoing_queue, this);
+				requeue_packets(&vpninfo->outgoing_queue, &batch);
+				dtls_restart(vpninfo, 1);
+				return 1;
 			} else if (gnutls_record_get_direction(vpninfo->dtls_ssl)) {
-				FD_SET(vpninfo->dtls_fd, &vpninfo->select_wfds);
-				vpninfo->outgoing_queue = this;
-				vpninfo->outgoing_qlen++;
+				monitor_write_fd(vpninfo, vpninfo->dtls_fd);
+				requeue_packet(&vpninfo->outgoing_queue, this);
 			}
-
-			return work_done;
+			break;
 		}
 #endif
-		time(&vpninfo->dtls_times.last_tx);
+		vpninfo->dtls_times.last_tx = vpninfo->now;
 		vpn_progress(vpninfo, PRG_TRACE,
 			     _("Sent DTLS packet of %d bytes; DTLS send returned %d\n"),
 			     this->len, ret);
-		free(this);
+		queue_packet(&batch, this);
+		recs[batch.count - 1] = vpninfo->dtls_io->tx_early +
+			vpninfo->dtls_io->tx_count;
 	}
 
+	ret = dtls_flush_batch(vpninfo, &batch, recs);
+ out:
+	if (ret < 0) {
+		dtls_restart(vpninfo, 1);
+		return 1;
+	}
+	vpninfo->dtls_io->tx_batching = 0;
 	return work_done;
 }
 #else /* !HAVE_DTLS */
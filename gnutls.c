@@ -1686,6 +1686,23 @@ int openconnect_get_cert_DER(struct openconnect_info *vpninfo,
 	return l;
 }
 
+static gnutls_x509_crt_t get_peer_cert(gnutls_session_t session)
+{
+	const gnutls_datum_t *cert_list;
+	unsigned int cert_list_size;
+	gnutls_x509_crt_t cert;
+
+	cert_list = gnutls_certificate_get_peers(session, &cert_list_size);
+	if (!cert_list || gnutls_x509_crt_init(&cert))
+		return NULL;
+
+	if (gnutls_x509_crt_import(cert, &cert_list[0], GNUTLS_X509_FMT_DER)) {
+		gnutls_x509_crt_deinit(cert);
+		return NULL;
+	}
+	return cert;
+}
+
 static int verify_peer(gnutls_session_t session)
 {
 	struct openconnect_info *vpninfo = gnutls_session_get_ptr(session);
@@ -1784,15 +1801,56 @@ static int verify_peer(gnutls_session_t session)
 	return err;
 }
 
+/* Prefer TLS 1.2 and later with AEAD ciphers, which NORMAL puts first */
+#define DEFAULT_TLS_PRIORITY "NORMAL:-VERS-SSL3.0:%COMPAT"
+
+/* What older Cisco ASA releases need: TLS 1.0 only, CBC+HMAC ciphers,
+   and no extensions they don't understand. The SCSV tells a server which
+   could have done better that someone is forcing the downgrade. */
+#define LEGACY_TLS_PRIORITY "NORMAL:-VERS-TLS-ALL:+VERS-TLS1.0:"	\
+	LEGACY_TLS_CURVES LEGACY_TLS_SCSV				\
+	"%COMPAT:%DISABLE_SAFE_RENEGOTIATION:%LATEST_RECORD_VERSION"
+#if GNUTLS_VERSION_MAJOR >= 3
+#define LEGACY_TLS_CURVES "-CURVE-ALL:"
+#else
+#define LEGACY_TLS_CURVES ""
+#endif
+#if GNUTLS_VERSION_NUMBER >= 0x03030a
+#define LEGACY_TLS_SCSV "%FALLBACK_SCSV:"
+#else
+#define LEGACY_TLS_SCSV ""
+#endif
+
+/* Old ASAs reject a modern ClientHello with one of these. Anything else,
+   like a reset connection, doesn't justify a downgrade. */
+static int is_tls_version_alert(gnutls_session_t sess, int err)
+{
+	if (err != GNUTLS_E_FATAL_ALERT_RECEIVED)
+		return 0;
+
+	switch (gnutls_alert_get(sess)) {
+	case GNUTLS_A_PROTOCOL_VERSION:
+	case GNUTLS_A_HANDSHAKE_FAILURE:
+		return 1;
+	default:
+		return 0;
+	}
+}
 
 int openconnect_open_https(struct openconnect_info *vpninfo)
 {
+	const char *prio;
 	int ssl_sock = -1;
 	int err;
 
 	if (vpninfo->https_sess)
 		return 0;
 
+	/* Only stick with the legacy settings for the server that needed them */
+	if (!can_resume_https(vpninfo))
+		vpninfo->tls_legacy = 0;
+
+ retry:
 	ssl_sock = connect_https_socket(vpninfo);
 	if (ssl_sock < 0)
 		return ssl_sock;
@@ -1895,23 +1953,30 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		gnutls_sign_callback_set(vpninfo->https_sess, gtls2_tpm_sign_cb, vpninfo);
 #endif
 
-	err = gnutls_priority_set_direct(vpninfo->https_sess,
-					 "NORMAL:-VERS-TLS-ALL:+VERS-TLS1.0:"
-#if GNUTLS_VERSION_MAJOR >= 3
-					 "-CURVE-ALL:"
-#endif
-					 "%COMPAT:%DISABLE_SAFE_RENEGOTIATION:%LATEST_RECORD_VERSION",
-					 NULL);
+	if (vpninfo->tls_priority)
+		prio = vpninfo->tls_priority;
+	else if (vpninfo->tls_legacy)
+		prio = LEGACY_TLS_PRIORITY;
+	else
+		prio = DEFAULT_TLS_PRIORITY;
+
+	err = gnutls_priority_set_direct(vpninfo->https_sess, prio, NULL);
 	if (err) {
 		vpn_progress(vpninfo, PRG_ERR,
-			     _("Failed to set TLS priority string: %s\n"),
-			     gnutls_strerror(err));
+			     _("Failed to set TLS priority string '%s': %s\n"),
+			     prio, gnutls_strerror(err));
 		gnutls_deinit(vpninfo->https_sess);
 		vpninfo->https_sess = NULL;
 		close(ssl_sock);
 		return -EIO;
 	}
 
+	/* Offer the session from last time, so a reconnect can skip
+	   the full handshake */
+	if (vpninfo->https_resume.data && can_resume_https(vpninfo))
+		gnutls_session_set_data(vpninfo->https_sess, vpninfo->https_resume.data,
+					vpninfo->https_resume.size);
+
 	gnutls_record_disable_padding(vpninfo->https_sess);
 	gnutls_credentials_set(vpninfo->https_sess, GNUTLS_CRD_CERTIFICATE, vpninfo->https_cred);
 	gnutls_transport_set_ptr(vpninfo->https_sess, /* really? */(gnutls_transport_ptr_t)(long) ssl_sock);
@@ -1942,11 +2007,25 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 				return -EINTR;
 			}
 		} else if (err == GNUTLS_E_INTERRUPTED || gnutls_error_is_fatal(err)) {
+			int version_alert = is_tls_version_alert(vpninfo->https_sess, err);
+
 			vpn_progress(vpninfo, PRG_ERR, _("SSL connection failure: %s\n"),
 							 gnutls_strerror(err));
 			gnutls_deinit(vpninfo->https_sess);
 			vpninfo->https_sess = NULL;
 			close(ssl_sock);
+			/* Old ASAs choke on anything but TLS 1.0. Try again
+			   with what they like. */
+			if (!vpninfo->tls_priority && !vpninfo->tls_legacy &&
+			    version_alert) {
+				vpn_progress(vpninfo, PRG_INFO,
+					     _("Retrying with TLS 1.0 for %s\n"),
+					     vpninfo->hostname);
+				vpninfo->tls_legacy = 1;
+				goto retry;
+			}
+			/* Only a successful TLS 1.0 connection makes it stick */
+			vpninfo->tls_legacy = 0;
 			return -EIO;
 		} else {
 			/* non-fatal error or warning. Ignore it and continue */
@@ -1956,6 +2035,19 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		}
 	}
 
+	if (set_https_resume_host(vpninfo)) {
+		gnutls_free(vpninfo->https_resume.data);
+		vpninfo->https_resume.data = NULL;
+	}
+
+	if (gnutls_session_is_resumed(vpninfo->https_sess)) {
+		vpn_progress(vpninfo, PRG_DEBUG, _("Resumed TLS session\n"));
+		/* verify_peer() wasn't called this time. The certificate
+		   was checked when the session was first established. */
+		if (!vpninfo->peer_cert)
+			vpninfo->peer_cert = get_peer_cert(vpninfo->https_sess);
+	}
+
 	vpninfo->ssl_fd = ssl_sock;
 
 	vpn_progress(vpninfo, PRG_INFO, _("Connected to HTTPS on %s\n"),
@@ -1964,6 +2056,148 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	return 0;
 }
 
+#if defined(HAVE_KTLS) && GNUTLS_VERSION_NUMBER >= 0x030603
+#include <netinet/tcp.h>
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+union ktls_crypto_info {
+	struct tls_crypto_info info;
+	struct tls12_crypto_info_aes_gcm_128 gcm128;
+	struct tls12_crypto_info_aes_gcm_256 gcm256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+	struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+};
+
+/* For AES-GCM, TLS 1.2 has a 4-byte implicit nonce (the salt) and sends
+   the rest explicitly, which is the sequence number as GnuTLS does it. */
+static int fill_gcm_info(gnutls_datum_t *iv, gnutls_datum_t *key,
+			 unsigned char *seq, unsigned char *c_iv,
+			 unsigned char *c_key, int c_keylen,
+			 unsigned char *c_salt, unsigned char *c_seq)
+{
+	if (key->size != c_keylen || iv->size != 4)
+		return -EINVAL;
+
+	memcpy(c_key, key->data, key->size);
+	memcpy(c_salt, iv->data, 4);
+	memcpy(c_iv, seq, 8);
+	memcpy(c_seq, seq, 8);
+	return 0;
+}
+
+#define GCM_INFO_FIELDS(c) (c).iv, (c).key, sizeof((c).key), (c).salt, (c).rec_seq
+
+/* Fill in the kernel's crypto_info for one direction of the session.
+   Returns its size, or a negative error if the kernel can't do it. */
+static int get_ktls_info(gnutls_session_t sess, int read,
+			 union ktls_crypto_info *ci)
+{
+	gnutls_datum_t mac_key, iv, key;
+	unsigned char seq[8];
+
+	/* TLS 1.3 has KeyUpdate and NewSessionTicket messages after the
+	   handshake, which GnuTLS would have to see and answer. So only
+	   TLS 1.2, where there's nothing but a HelloRequest that we're
+	   free to ignore. */
+	if (gnutls_protocol_get_version(sess) != GNUTLS_TLS1_2)
+		return -EOPNOTSUPP;
+
+	if (gnutls_record_get_state(sess, read, &mac_key, &iv, &key, seq))
+		return -EINVAL;
+
+	memset(ci, 0, sizeof(*ci));
+	ci->info.version = TLS_1_2_VERSION;
+
+	switch (gnutls_cipher_get(sess)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		if (fill_gcm_info(&iv, &key, seq, GCM_INFO_FIELDS(ci->gcm128)))
+			return -EINVAL;
+		return sizeof(ci->gcm128);
+
+	case GNUTLS_CIPHER_AES_256_GCM:
+		ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		if (fill_gcm_info(&iv, &key, seq, GCM_INFO_FIELDS(ci->gcm256)))
+			return -EINVAL;
+		return sizeof(ci->gcm256);
+
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		/* The whole 12-byte IV is implicit */
+		if (key.size != sizeof(ci->chacha.key) ||
+		    iv.size != sizeof(ci->chacha.iv))
+			return -EINVAL;
+		ci->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy(ci->chacha.key, key.data, key.size);
+		memcpy(ci->chacha.iv, iv.data, iv.size);
+		memcpy(ci->chacha.rec_seq, seq, 8);
+		return sizeof(ci->chacha);
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/* Once CSTP is established, hand the record encryption over to the kernel
+   if it can do it for the protocol and cipher suite we have. If not,
+   GnuTLS carries on as before. */
+void openconnect_setup_ktls(struct openconnect_info *vpninfo)
+{
+	union ktls_crypto_info tx, rx;
+	int txlen, rxlen;
+
+	txlen = get_ktls_info(vpninfo->https_sess, 0, &tx);
+	rxlen = get_ktls_info(vpninfo->https_sess, 1, &rx);
+	if (txlen < 0 || rxlen < 0) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Kernel TLS not supported for this cipher suite\n"));
+		goto out;
+	}
+
+	/* Anything that GnuTLS has already read from the socket would be
+	   lost to the kernel */
+	if (gnutls_record_check_pending(vpninfo->https_sess)) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Not using kernel TLS with data pending\n"));
+		goto out;
+	}
+
+	if (setsockopt(vpninfo->ssl_fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"))) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Kernel TLS not available: %s\n"), strerror(errno));
+		goto out;
+	}
+
+	/* The receive side goes first. Once the kernel has the transmit
+	   side, GnuTLS mustn't write anything, and it would have to if it
+	   were still reading. Doing without kernel TLS for transmit is
+	   fine though; GnuTLS just carries on sending. */
+	if (setsockopt(vpninfo->ssl_fd, SOL_TLS, TLS_RX, &rx, rxlen)) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Failed to enable kernel TLS: %s\n"), strerror(errno));
+		goto out;
+	}
+	vpninfo->ktls_rx = 1;
+
+	if (!setsockopt(vpninfo->ssl_fd, SOL_TLS, TLS_TX, &tx, txlen))
+		vpninfo->ktls_tx = 1;
+
+	vpninfo->ktls_active = 1;
+	vpn_progress(vpninfo, PRG_INFO, _("Using kernel TLS for %s\n"),
+		     vpninfo->ktls_tx ? _("sending and receiving") : _("receiving"));
+ out:
+	memset(&tx, 0, sizeof(tx));
+	memset(&rx, 0, sizeof(rx));
+}
+#else
+void openconnect_setup_ktls(struct openconnect_info *vpninfo)
+{
+}
+#endif
+
 void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 {
 	if (vpninfo->peer_cert) {
@@ -1971,14 +2205,25 @@ void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 		vpninfo->peer_cert = NULL;
 	}
 	if (vpninfo->https_sess) {
+		gnutls_datum_t data;
+
+		/* Keep the session (or ticket) to resume on reconnect */
+		if (!gnutls_session_get_data2(vpninfo->https_sess, &data)) {
+			gnutls_free(vpninfo->https_resume.data);
+			vpninfo->https_resume = data;
+		}
 		gnutls_deinit(vpninfo->https_sess);
 		vpninfo->https_sess = NULL;
 	}
+	vpninfo->ktls_active = vpninfo->ktls_tx = vpninfo->ktls_rx = 0;
+	vpninfo->ktls_tx_sent = 0;
+	if (final && vpninfo->https_resume.data) {
+		gnutls_free(vpninfo->https_resume.data);
+		vpninfo->https_resume.data = NULL;
+	}
 	if (vpninfo->ssl_fd != -1) {
+		unmonitor_fd(vpninfo, vpninfo->ssl_fd);
 		close(vpninfo->ssl_fd);
-		FD_CLR(vpninfo->ssl_fd, &vpninfo->select_rfds);
-		FD_CLR(vpninfo->ssl_fd, &vpninfo->select_wfds);
-		FD_CLR(vpninfo->ssl_fd, &vpninfo->select_efds);
 		vpninfo->ssl_fd = -1;
 	}
 	if (final && vpninfo->https_cred) {
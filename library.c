@@ -55,10 +55,19 @@ struct openconnect_info *openconnect_vpninfo_new(char *useragent,
 		return NULL;
 
 	vpninfo->tun_fd = vpninfo->ssl_fd = vpninfo->dtls_fd = vpninfo->new_dtls_fd = -1;
+#ifdef HAVE_EPOLL
+	vpninfo->epoll_fd = -1;
+#endif
 	vpninfo->cmd_fd = vpninfo->cmd_fd_write = -1;
 	vpninfo->cert_expire_warning = 60 * 86400;
 	vpninfo->deflate = 1;
+	vpninfo->compr_cpu_budget = COMPR_CPU_BUDGET;
 	vpninfo->max_qlen = 10;
+	vpninfo->pkt_headroom = PKT_HEADROOM;
+	vpninfo->pkt_tailroom = PKT_TAILROOM;
+	/* openconnect_mainloop() overrides these */
+	vpninfo->reconnect_timeout = 300;
+	vpninfo->reconnect_interval = RECONNECT_INTERVAL_MIN;
 	vpninfo->localname = strdup("localhost");
 	vpninfo->useragent = openconnect_create_useragent(useragent);
 	vpninfo->validate_peer_cert = validate_peer_cert;
@@ -135,12 +144,29 @@ static void free_optlist(struct oc_vpn_option *opt)
 
 void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 {
+	if (vpninfo->group)
+		openconnect_group_remove(vpninfo->group, vpninfo);
 	openconnect_close_https(vpninfo, 1);
+	free(vpninfo->https_resume_host);
+	free_resolve_cache(vpninfo);
 	dtls_close(vpninfo, 1);
 	if (vpninfo->cmd_fd_write != -1) {
 		close(vpninfo->cmd_fd);
 		close(vpninfo->cmd_fd_write);
 	}
+#ifdef HAVE_EPOLL
+	if (vpninfo->epoll_fd != -1)
+		close(vpninfo->epoll_fd);
+#endif
+	free_pkt_queue(&vpninfo->incoming_queue);
+	free_pkt_queue(&vpninfo->outgoing_queue);
+	free_pkt_queue(&vpninfo->pending_ssl_pkts);
+	free_pkt_queue(&vpninfo->free_pkts);
+	free(vpninfo->cstp_pkt);
+	free(vpninfo->cstp_tx_batch);
+	free(vpninfo->cstp_rx_buf);
+	free(vpninfo->tun_pkt);
+	free(vpninfo->dtls_pkt);
 	free(vpninfo->peer_addr);
 	free_optlist(vpninfo->cookies);
 	free_optlist(vpninfo->cstp_options);
@@ -154,6 +180,7 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	free(vpninfo->proxy);
 	free(vpninfo->vpnc_script);
 	free(vpninfo->cafile);
+	free(vpninfo->tls_priority);
 	free(vpninfo->servercert);
 	free(vpninfo->ifname);
 	free(vpninfo->dtls_cipher);
@@ -207,7 +234,6 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	inflateEnd(&vpninfo->inflate_strm);
 	deflateEnd(&vpninfo->deflate_strm);
 
-	free(vpninfo->deflate_pkt);
 	free(vpninfo);
 }
 
@@ -249,9 +275,24 @@ void openconnect_set_cafile(struct openconnect_info *vpninfo, char *cafile)
 	vpninfo->cafile = cafile;
 }
 
+void openconnect_set_tls_priority(struct openconnect_info *vpninfo, char *priority)
+{
+	free(vpninfo->tls_priority);
+	vpninfo->tls_priority = priority;
+}
+
+/* Resuming a TLS session skips the certificate checks, so don't do it
+   after the caller changes what they should be. */
+static void forget_https_session(struct openconnect_info *vpninfo)
+{
+	free(vpninfo->https_resume_host);
+	vpninfo->https_resume_host = NULL;
+}
+
 void openconnect_set_server_cert_sha1(struct openconnect_info *vpninfo, char *servercert)
 {
 	vpninfo->servercert = servercert;
+	forget_https_session(vpninfo);
 }
 
 const char *openconnect_get_ifname(struct openconnect_info *vpninfo)
@@ -264,6 +305,25 @@ void openconnect_set_reqmtu(struct openconnect_info *vpninfo, int reqmtu)
 	vpninfo->reqmtu = reqmtu;
 }
 
+void openconnect_set_compression_cpu_budget(struct openconnect_info *vpninfo, int percent)
+{
+	if (percent < 1)
+		percent = 1;
+	else if (percent > 100)
+		percent = 100;
+	vpninfo->compr_cpu_budget = percent;
+}
+
+int openconnect_set_pkt_room(struct openconnect_info *vpninfo, int headroom, int tailroom)
+{
+	if (headroom < PKT_HEADROOM || tailroom < PKT_TAILROOM)
+		return -EINVAL;
+
+	vpninfo->pkt_headroom = headroom;
+	vpninfo->pkt_tailroom = tailroom;
+	return 0;
+}
+
 int openconnect_get_ip_info(struct openconnect_info *vpninfo,
 			    const struct oc_ip_info **info,
 			    const struct oc_vpn_option **cstp_options,
@@ -297,6 +357,7 @@ void openconnect_set_client_cert(struct openconnect_info *vpninfo, char *cert, c
 		vpninfo->sslkey = sslkey;
 	else
 		vpninfo->sslkey = cert;
+	forget_https_session(vpninfo);
 }
 
 OPENCONNECT_X509 *openconnect_get_peer_cert(struct openconnect_info *vpninfo)
@@ -323,6 +384,7 @@ void openconnect_clear_cookie(struct openconnect_info *vpninfo)
 void openconnect_reset_ssl(struct openconnect_info *vpninfo)
 {
 	openconnect_close_https(vpninfo, 0);
+	forget_https_session(vpninfo);
 	if (vpninfo->peer_addr) {
 		free(vpninfo->peer_addr);
 		vpninfo->peer_addr = NULL;
@@ -364,7 +426,9 @@ void openconnect_set_cert_expiry_warning(struct openconnect_info *vpninfo,
 
 void openconnect_set_cancel_fd(struct openconnect_info *vpninfo, int fd)
 {
+	unmonitor_fd(vpninfo, vpninfo->cmd_fd);
 	vpninfo->cmd_fd = fd;
+	monitor_read_fd(vpninfo, fd);
 }
 
 int openconnect_setup_cmd_pipe(struct openconnect_info *vpninfo)
@@ -379,8 +443,10 @@ int openconnect_setup_cmd_pipe(struct openconnect_info *vpninfo)
 		close(pipefd[1]);
 		return -EIO;
 	}
+	unmonitor_fd(vpninfo, vpninfo->cmd_fd);
 	vpninfo->cmd_fd = pipefd[0];
 	vpninfo->cmd_fd_write = pipefd[1];
+	monitor_read_fd(vpninfo, vpninfo->cmd_fd);
 	return vpninfo->cmd_fd_write;
 }
 
@@ -125,6 +125,8 @@ enum {
 	OPT_TOKEN_SECRET,
 	OPT_OS,
 	OPT_TIMESTAMP,
+	OPT_TLS_PRIORITY,
+	OPT_COMPRESSION_CPU,
 };
 
 #ifdef __sun__
@@ -145,6 +147,7 @@ static struct option long_options[] = {
 	OPTION("cookie", 1, 'C'),
 	OPTION("deflate", 0, 'd'),
 	OPTION("no-deflate", 0, 'D'),
+	OPTION("compression-cpu", 1, OPT_COMPRESSION_CPU),
 	OPTION("cert-expire-warning", 1, 'e'),
 	OPTION("usergroup", 1, 'g'),
 	OPTION("help", 0, 'h'),
@@ -177,6 +180,7 @@ static struct option long_options[] = {
 	OPTION("dtls-ciphers", 1, OPT_DTLS_CIPHERS),
 	OPTION("authgroup", 1, OPT_AUTHGROUP),
 	OPTION("servercert", 1, OPT_SERVERCERT),
+	OPTION("tls-priority", 1, OPT_TLS_PRIORITY),
 	OPTION("key-password-from-fsid", 0, OPT_KEY_PASSWORD_FROM_FSID),
 	OPTION("useragent", 1, OPT_USERAGENT),
 	OPTION("csd-user", 1, OPT_CSD_USER),
@@ -262,6 +266,7 @@ static void usage(void)
 	printf("      --cookie-on-stdin           %s\n", _("Read cookie from standard input"));
 	printf("  -d, --deflate                   %s\n", _("Enable compression (default)"));
 	printf("  -D, --no-deflate                %s\n", _("Disable compression"));
+	printf("      --compression-cpu=PERCENT   %s\n", _("Limit time spent compressing (default 20%)"));
 	printf("      --force-dpd=INTERVAL        %s\n", _("Set minimum Dead Peer Detection interval"));
 	printf("  -g, --usergroup=GROUP           %s\n", _("Set login usergroup"));
 	printf("  -h, --help                      %s\n", _("Display help text"));
@@ -315,6 +320,7 @@ static void usage(void)
 #endif
 	printf("      --reconnect-timeout         %s\n", _("Connection retry timeout in seconds"));
 	printf("      --servercert=FINGERPRINT    %s\n", _("Server's certificate SHA1 fingerprint"));
+	printf("      --tls-priority=STRING       %s\n", _("TLS versions and ciphers to offer for HTTPS"));
 	printf("      --useragent=STRING          %s\n", _("HTTP header User-Agent: field"));
 	printf("      --os=STRING                 %s\n", _("OS type (linux,linux-64,win,...) to report"));
 	printf("      --dtls-local-port=PORT      %s\n", _("Set local port for DTLS datagrams"));
@@ -583,6 +589,9 @@ int main(int argc, char **argv)
 		case OPT_SERVERCERT:
 			openconnect_set_server_cert_sha1(vpninfo, xstrdup(config_arg));
 			break;
+		case OPT_TLS_PRIORITY:
+			openconnect_set_tls_priority(vpninfo, xstrdup(config_arg));
+			break;
 		case OPT_NO_DTLS:
 			use_dtls = 0;
 			break;
@@ -773,6 +782,9 @@ int main(int argc, char **argv)
 		case OPT_FORCE_DPD:
 			vpninfo->dtls_times.dpd = vpninfo->ssl_times.dpd = atoi(config_arg);
 			break;
+		case OPT_COMPRESSION_CPU:
+			openconnect_set_compression_cpu_budget(vpninfo, atoi(config_arg));
+			break;
 		case OPT_DTLS_LOCAL_PORT:
 			vpninfo->dtls_local_port = atoi(config_arg);
 			break;
@@ -29,31 +29,415 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "openconnect-internal.h"
 
-void queue_packet(struct pkt **q, struct pkt *new)
+static struct monitored_fd *find_monitored_fd(struct openconnect_info *vpninfo, int fd)
 {
-	while (*q)
-		q = &(*q)->next;
+	int i;
 
-	new->next = NULL;
-	*q = new;
+	for (i = 0; i < vpninfo->nr_monitored_fds; i++) {
+		if (vpninfo->monitored_fds[i].fd == fd)
+			return &vpninfo->monitored_fds[i];
+	}
+	return NULL;
+}
+
+#ifdef HAVE_EPOLL
+static uint32_t epoll_events(int events)
+{
+	uint32_t ev = 0;
+
+	if (events & FD_EV_READ)
+		ev |= EPOLLIN;
+	if (events & FD_EV_WRITE)
+		ev |= EPOLLOUT;
+	if (events & FD_EV_EXCEPT)
+		ev |= EPOLLPRI;
+	return ev;
+}
+
+static int epoll_update_fd(struct openconnect_info *vpninfo, int op,
+			   struct monitored_fd *mfd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = epoll_events(mfd->events);
+	ev.data.fd = mfd->fd;
+
+	if (epoll_ctl(vpninfo->epoll_fd, op, mfd->fd, &ev) < 0) {
+		/* Not everything can be polled with epoll (for example, a
+		   legacy cancel fd which is a regular file). The fd_sets
+		   are always kept up to date, so just fall back to select() */
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("epoll_ctl() failed on fd %d: %s; falling back to select()\n"),
+			     mfd->fd, strerror(errno));
+		close(vpninfo->epoll_fd);
+		vpninfo->epoll_fd = -1;
+		return -EIO;
+	}
+	return 0;
+}
+
+/* Created when the mainloop starts (not in openconnect_vpninfo_new())
+   because main.c forks into the background after connecting. The child
+   would inherit the epoll fd, but it would refer to the same epoll
+   instance as the parent's, so the two would share one set of
+   registrations and anything either did to it would affect the other. */
+static void setup_epoll(struct openconnect_info *vpninfo)
+{
+	int i;
+
+	if (vpninfo->epoll_fd != -1)
+		return;
+
+	vpninfo->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (vpninfo->epoll_fd < 0) {
+		vpninfo->epoll_fd = -1;
+		return;
+	}
+
+	for (i = 0; i < vpninfo->nr_monitored_fds; i++) {
+		if (epoll_update_fd(vpninfo, EPOLL_CTL_ADD, &vpninfo->monitored_fds[i]))
+			return;
+	}
+}
+#endif
+
+/* Add and remove events of interest for a file descriptor, adding it to
+   the set we monitor if it isn't there already. This only results in a
+   system call (with epoll) when the set of events actually changes. */
+void monitor_fd_events(struct openconnect_info *vpninfo, int fd, int set, int clear)
+{
+	struct monitored_fd *mfd;
+	int events;
+
+	if (fd < 0)
+		return;
+
+	mfd = find_monitored_fd(vpninfo, fd);
+	if (!mfd) {
+		if (vpninfo->nr_monitored_fds == MAX_MONITORED_FDS) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Too many file descriptors to monitor\n"));
+			return;
+		}
+		mfd = &vpninfo->monitored_fds[vpninfo->nr_monitored_fds++];
+		mfd->fd = fd;
+		mfd->events = (set & ~clear);
+#ifdef HAVE_EPOLL
+		if (vpninfo->epoll_fd != -1)
+			epoll_update_fd(vpninfo, EPOLL_CTL_ADD, mfd);
+#endif
+		if (fd >= vpninfo->select_nfds)
+			vpninfo->select_nfds = fd + 1;
+		events = 0;
+	} else {
+		events = mfd->events;
+		mfd->events = (events | set) & ~clear;
+		if (mfd->events == events)
+			return;
+#ifdef HAVE_EPOLL
+		if (vpninfo->epoll_fd != -1)
+			epoll_update_fd(vpninfo, EPOLL_CTL_MOD, mfd);
+#endif
+	}
+
+	/* It can't go in the fd_sets. That's fine with epoll or
+	   openconnect_get_pollfds(), but openconnect_mainloop() will
+	   give up if it has to use select(). */
+	if (fd >= FD_SETSIZE)
+		return;
+
+	if ((mfd->events ^ events) & FD_EV_READ) {
+		if (mfd->events & FD_EV_READ)
+			FD_SET(fd, &vpninfo->select_rfds);
+		else
+			FD_CLR(fd, &vpninfo->select_rfds);
+	}
+	if ((mfd->events ^ events) & FD_EV_WRITE) {
+		if (mfd->events & FD_EV_WRITE)
+			FD_SET(fd, &vpninfo->select_wfds);
+		else
+			FD_CLR(fd, &vpninfo->select_wfds);
+	}
+	if ((mfd->events ^ events) & FD_EV_EXCEPT) {
+		if (mfd->events & FD_EV_EXCEPT)
+			FD_SET(fd, &vpninfo->select_efds);
+		else
+			FD_CLR(fd, &vpninfo->select_efds);
+	}
+}
+
+int monitored_fd_events(struct openconnect_info *vpninfo, int fd)
+{
+	struct monitored_fd *mfd = find_monitored_fd(vpninfo, fd);
+
+	return mfd ? mfd->events : 0;
+}
+
+/* Must be called before the fd is closed */
+void unmonitor_fd(struct openconnect_info *vpninfo, int fd)
+{
+	struct monitored_fd *mfd = find_monitored_fd(vpninfo, fd);
+
+	if (!mfd)
+		return;
+
+#ifdef HAVE_EPOLL
+	if (vpninfo->epoll_fd != -1)
+		epoll_ctl(vpninfo->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+	if (fd < FD_SETSIZE) {
+		FD_CLR(fd, &vpninfo->select_rfds);
+		FD_CLR(fd, &vpninfo->select_wfds);
+		FD_CLR(fd, &vpninfo->select_efds);
+	}
+	*mfd = vpninfo->monitored_fds[--vpninfo->nr_monitored_fds];
+}
+
+static int pkt_size(struct openconnect_info *vpninfo, int len)
+{
+	if (len < vpninfo->ip_info.mtu)
+		len = vpninfo->ip_info.mtu;
+
+	return vpninfo->pkt_headroom + len + vpninfo->pkt_tailroom;
+}
+
+/* Returns an empty packet with room for at least len bytes (and at least
+   the MTU) plus the session's headroom and tailroom. Packets of exactly
+   the size for the current MTU are recycled through a free list, of up
+   to max_qlen packets. Anything bigger is just malloc()ed. */
+struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len)
+{
+	int pool_size = pkt_size(vpninfo, 0);
+	int size = pkt_size(vpninfo, len);
+	struct pkt *pkt;
+
+	if (size == pool_size) {
+		while ((pkt = dequeue_packet(&vpninfo->free_pkts))) {
+			if (pkt->alloc_len == pool_size) {
+				vpninfo->stats.pool_hits++;
+				goto out;
+			}
+			/* Left over from before the MTU was changed */
+			free(pkt);
+		}
+	}
+
+	vpninfo->stats.pool_misses++;
+	pkt = malloc(sizeof(struct pkt) + size);
+	if (!pkt)
+		return NULL;
+	pkt->alloc_len = size;
+	pkt->next = NULL;
+ out:
+	pkt->data = pkt->buf + vpninfo->pkt_headroom;
+	pkt->len = 0;
+	return pkt;
 }
 
-int queue_new_packet(struct pkt **q, void *buf, int len)
+/* Receive buffers are kept in *cache until they're used for a packet.
+   Return the cached one if it's still big enough, or a new one. */
+struct pkt *get_rx_pkt(struct openconnect_info *vpninfo, struct pkt **cache, int len)
 {
-	struct pkt *new = malloc(sizeof(struct pkt) + len);
+	struct pkt *pkt = *cache;
+
+	if (pkt && pkt->alloc_len >= pkt_size(vpninfo, len)) {
+		pkt->data = pkt->buf + vpninfo->pkt_headroom;
+		pkt->len = 0;
+		return pkt;
+	}
+
+	free_pkt(vpninfo, pkt);
+	*cache = alloc_pkt(vpninfo, len);
+	return *cache;
+}
+
+void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	if (!pkt)
+		return;
+
+	if (vpninfo->free_pkts.count < vpninfo->max_qlen &&
+	    pkt->alloc_len == pkt_size(vpninfo, 0)) {
+		/* The free list doesn't care about payload lengths */
+		pkt->len = 0;
+		queue_packet(&vpninfo->free_pkts, pkt);
+	} else
+		free(pkt);
+}
+
+/* Adapt the limit on the outgoing queue, in the style of the kernel's
+ * dynamic queue limits. This is called after the transports have sent
+ * as much as they can, and before the tun device is read.
+ *
+ * If the transport emptied the queue while we had stopped reading from
+ * the tun device because of the limit, the limit was holding back the
+ * throughput and needs to grow. Otherwise whatever is left standing in
+ * the queue is just adding latency; if there has never been less than
+ * that for a while, shrink the limit by that much.
+ *
+ * The limit always lies between two packets and max_qlen packets of the
+ * MTU. */
+void update_tx_queue_limit(struct openconnect_info *vpninfo)
+{
+	int queued = vpninfo->outgoing_queue.bytes;
+	int min = 2 * vpninfo->ip_info.mtu;
+	int max = vpninfo->max_qlen * vpninfo->ip_info.mtu;
+	int throttled = vpninfo->tun_fd != -1 &&
+		!is_read_fd_monitored(vpninfo, vpninfo->tun_fd);
+
+	if (!vpninfo->tx_qlimit)
+		vpninfo->tx_qlimit = max;
+
+	if (!queued && throttled) {
+		vpninfo->tx_qlimit += vpninfo->tx_qlimit / 2;
+		vpninfo->tx_slack_min = INT_MAX;
+		vpninfo->tx_slack_start = vpninfo->now;
+	} else if (!queued) {
+		vpninfo->tx_slack_min = INT_MAX;
+		vpninfo->tx_slack_start = vpninfo->now;
+	} else {
+		if (queued < vpninfo->tx_slack_min)
+			vpninfo->tx_slack_min = queued;
+
+		if (vpninfo->now >= vpninfo->tx_slack_start + TX_SLACK_HOLD_TIME) {
+			vpninfo->tx_qlimit -= vpninfo->tx_slack_min;
+			vpninfo->tx_slack_min = INT_MAX;
+			vpninfo->tx_slack_start = vpninfo->now;
+		}
+	}
+
+	if (vpninfo->tx_qlimit > max)
+		vpninfo->tx_qlimit = max;
+	if (vpninfo->tx_qlimit < min)
+		vpninfo->tx_qlimit = min;
+
+	vpninfo->stats.tx_queue_limit = vpninfo->tx_qlimit;
+	vpninfo->stats.tx_queue_bytes = queued;
+}
+
+/* A packet from the outgoing queue has been sent */
+void tx_pkt_sent(struct openconnect_info *vpninfo, struct pkt *pkt)
+{
+	int sojourn = vpninfo->now - pkt->queued;
+
+	if (vpninfo->now < pkt->queued)
+		sojourn = 0;
+
+	vpninfo->tx_sojourn_avg8 += sojourn - vpninfo->tx_sojourn_avg8 / 8;
+	vpninfo->stats.tx_sojourn_avg_ms = vpninfo->tx_sojourn_avg8 / 8;
+	if (sojourn > vpninfo->stats.tx_sojourn_max_ms)
+		vpninfo->stats.tx_sojourn_max_ms = sojourn;
+}
+
+int queue_new_packet(struct openconnect_info *vpninfo, struct pkt_queue *q,
+		     void *buf, int len)
+{
+	struct pkt *new = alloc_pkt(vpninfo, len);
 	if (!new)
 		return -ENOMEM;
 
 	new->len = len;
-	new->next = NULL;
 	memcpy(new->data, buf, len);
 	queue_packet(q, new);
 	return 0;
 }
 
+void free_pkt_queue(struct pkt_queue *q)
+{
+	struct pkt *this;
+
+	while ((this = dequeue_packet(q)))
+		free(this);
+}
+
+/* One pass through the DTLS, CSTP and tun handling, none of which will
+ * block (except while reconnecting). *timeout is reduced to the time
+ * until the next thing we need to do.
+ * Return value:
+ *  > 0, if any work was done (so we should come straight back)
+ *  = 0, if there was nothing to do
+ *  < 0, if the session has ended; vpninfo->quit_reason says why
+ */
+static int mainloop_pass(struct openconnect_info *vpninfo, int *timeout)
+{
+	int did_work = 0;
+	int ret = 0;
+
+	/* Every timer in this pass works from the same timestamp;
+	   there's no point asking the kernel for it per packet. */
+	vpninfo->now = vpn_time_ms();
+
+#ifdef HAVE_DTLS
+	if (vpninfo->new_dtls_ssl)
+		dtls_try_handshake(vpninfo);
+
+	if (vpninfo->dtls_attempt_period && !vpninfo->dtls_ssl && !vpninfo->new_dtls_ssl &&
+	    vpninfo->ssl_fd != -1) {
+		uint64_t due = vpninfo->new_dtls_started +
+			vpninfo->dtls_attempt_period * 1000;
+
+		if (vpninfo->now >= due) {
+			vpn_progress(vpninfo, PRG_TRACE, _("Attempt new DTLS connection\n"));
+			connect_dtls_socket(vpninfo);
+		} else
+			set_deadline(timeout, due, vpninfo->now);
+	}
+	if (vpninfo->new_dtls_ssl)
+		set_deadline(timeout, vpninfo->new_dtls_started +
+			     DTLS_HANDSHAKE_TIMEOUT, vpninfo->now);
+	if (vpninfo->dtls_ssl) {
+		ret = dtls_mainloop(vpninfo, timeout);
+		did_work += ret;
+	}
+#endif
+	if (vpninfo->quit_reason)
+		goto quit;
+
+	ret = cstp_mainloop(vpninfo, timeout);
+	if (vpninfo->quit_reason)
+		goto quit;
+	did_work += ret;
+
+	/* Tun must be last because it will set/clear its bit
+	   in the select_rfds according to the queue length */
+	did_work += tun_mainloop(vpninfo, timeout);
+	if (vpninfo->quit_reason)
+		goto quit;
+
+	return did_work;
+
+ quit:
+	return ret < 0 ? ret : -EIO;
+}
+
+/* Act on any cancel or pause command which has been received on cmd_fd.
+   Returns -EINTR if cancelled, 1 if paused, or zero. */
+static int handle_cmds(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->got_cancel_cmd) {
+		vpninfo->quit_reason = "Aborted by caller";
+		return -EINTR;
+	}
+	if (vpninfo->got_pause_cmd) {
+		/* close all connections and wait for the user to call
+		   openconnect_mainloop() again */
+		openconnect_close_https(vpninfo, 0);
+		dtls_close(vpninfo, 1);
+		vpninfo->new_dtls_started = 0;
+
+		vpninfo->got_pause_cmd = 0;
+		vpn_progress(vpninfo, PRG_INFO, _("Caller paused the connection\n"));
+		return 1;
+	}
+	return 0;
+}
+
 /* Return value:
  *  = 0, when successfully paused (may call again)
  *  = -EINTR, if aborted locally via cmd_fd
@@ -70,135 +454,240 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 	vpninfo->reconnect_timeout = reconnect_timeout;
 	vpninfo->reconnect_interval = reconnect_interval;
 
-	if (vpninfo->cmd_fd != -1) {
-		FD_SET(vpninfo->cmd_fd, &vpninfo->select_rfds);
-		if (vpninfo->cmd_fd >= vpninfo->select_nfds)
-			vpninfo->select_nfds = vpninfo->cmd_fd + 1;
-	}
+#ifdef HAVE_EPOLL
+	setup_epoll(vpninfo);
+#endif
 
 	while (!vpninfo->quit_reason) {
-		int did_work = 0;
 		int timeout = INT_MAX;
-		struct timeval tv;
-		fd_set rfds, wfds, efds;
 
-#ifdef HAVE_DTLS
-		if (vpninfo->new_dtls_ssl)
-			dtls_try_handshake(vpninfo);
+		ret = mainloop_pass(vpninfo, &timeout);
+		if (ret < 0)
+			break;
 
-		if (vpninfo->dtls_attempt_period && !vpninfo->dtls_ssl && !vpninfo->new_dtls_ssl &&
-		    vpninfo->new_dtls_started + vpninfo->dtls_attempt_period < time(NULL) &&
-		    vpninfo->ssl_fd != -1) {
-			vpn_progress(vpninfo, PRG_TRACE, _("Attempt new DTLS connection\n"));
-			connect_dtls_socket(vpninfo);
-		}
-		if (vpninfo->dtls_ssl) {
-			ret = dtls_mainloop(vpninfo, &timeout);
-			did_work += ret;
+		if (ret) {
+			/* Don't go back to the main wait on every pass while
+			   we're busy, but don't starve the command fd either.
+			   Every so often, poll everything without sleeping. */
+			if (++vpninfo->busy_passes < CMD_POLL_PASSES)
+				continue;
+			timeout = 0;
+		} else {
+			vpn_progress(vpninfo, PRG_TRACE,
+				     _("No work to do; sleeping for %d ms...\n"), timeout);
 		}
+		vpninfo->busy_passes = 0;
+
+#ifdef HAVE_EPOLL
+		if (vpninfo->epoll_fd != -1) {
+			struct epoll_event evs[MAX_MONITORED_FDS];
+			int i, nfds;
+
+			nfds = epoll_wait(vpninfo->epoll_fd, evs, MAX_MONITORED_FDS, timeout);
+			for (i = 0; i < nfds; i++) {
+				if (evs[i].data.fd == vpninfo->cmd_fd)
+					read_cmd_fd(vpninfo);
+			}
+		} else
 #endif
-		if (vpninfo->quit_reason)
-			break;
+		{
+			struct timeval tv;
+			fd_set rfds, wfds, efds;
+			int i;
+
+			for (i = 0; i < vpninfo->nr_monitored_fds; i++) {
+				if (vpninfo->monitored_fds[i].fd >= FD_SETSIZE)
+					break;
+			}
+			if (i < vpninfo->nr_monitored_fds) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("File descriptor %d too large for select()\n"),
+					     vpninfo->monitored_fds[i].fd);
+				vpninfo->quit_reason = "File descriptor too large";
+				ret = -EIO;
+				break;
+			}
+
+			memcpy(&rfds, &vpninfo->select_rfds, sizeof(rfds));
+			memcpy(&wfds, &vpninfo->select_wfds, sizeof(wfds));
+			memcpy(&efds, &vpninfo->select_efds, sizeof(efds));
+
+			tv.tv_sec = timeout / 1000;
+			tv.tv_usec = (timeout % 1000) * 1000;
+
+			/* select_nfds may still count a big fd that's gone now */
+			if (select(vpninfo->select_nfds < FD_SETSIZE ?
+				   vpninfo->select_nfds : FD_SETSIZE,
+				   &rfds, &wfds, &efds, &tv) > 0)
+				check_cmd_fd(vpninfo, &rfds);
+		}
 
-		ret = cstp_mainloop(vpninfo, &timeout);
-		if (vpninfo->quit_reason)
+		ret = handle_cmds(vpninfo);
+		if (ret < 0)
 			break;
-		did_work += ret;
+		if (ret)
+			return 0;
+	}
 
-		/* Tun must be last because it will set/clear its bit
-		   in the select_rfds according to the queue length */
-		did_work += tun_mainloop(vpninfo, &timeout);
-		if (vpninfo->quit_reason)
-			break;
+	cstp_bye(vpninfo, vpninfo->quit_reason);
 
-		poll_cmd_fd(vpninfo, 0);
-		if (vpninfo->got_cancel_cmd) {
-			vpninfo->quit_reason = "Aborted by caller";
-			ret = -EINTR;
-			break;
-		}
-		if (vpninfo->got_pause_cmd) {
-			/* close all connections and wait for the user to call
-			   openconnect_mainloop() again */
-			openconnect_close_https(vpninfo, 0);
-			dtls_close(vpninfo, 1);
-			vpninfo->new_dtls_started = 0;
-
-			vpninfo->got_pause_cmd = 0;
-			vpn_progress(vpninfo, PRG_INFO, _("Caller paused the connection\n"));
-			return 0;
-		}
+	shutdown_tun(vpninfo);
+	return ret < 0 ? ret : -EIO;
+}
 
-		if (did_work)
-			continue;
+int openconnect_get_pollfds(struct openconnect_info *vpninfo,
+			    struct pollfd *fds, int nr_fds)
+{
+	int i;
+
+	for (i = 0; i < vpninfo->nr_monitored_fds && i < nr_fds; i++) {
+		struct monitored_fd *mfd = &vpninfo->monitored_fds[i];
+
+		fds[i].fd = mfd->fd;
+		fds[i].events = 0;
+		fds[i].revents = 0;
+		if (mfd->events & FD_EV_READ)
+			fds[i].events |= POLLIN;
+		if (mfd->events & FD_EV_WRITE)
+			fds[i].events |= POLLOUT;
+		if (mfd->events & FD_EV_EXCEPT)
+			fds[i].events |= POLLPRI;
+	}
+	return vpninfo->nr_monitored_fds;
+}
 
-		vpn_progress(vpninfo, PRG_TRACE,
-			     _("No work to do; sleeping for %d ms...\n"), timeout);
-		memcpy(&rfds, &vpninfo->select_rfds, sizeof(rfds));
-		memcpy(&wfds, &vpninfo->select_wfds, sizeof(wfds));
-		memcpy(&efds, &vpninfo->select_efds, sizeof(efds));
+int openconnect_get_next_timeout(struct openconnect_info *vpninfo)
+{
+	uint64_t now;
 
-		tv.tv_sec = timeout / 1000;
-		tv.tv_usec = (timeout % 1000) * 1000;
+	if (!vpninfo->next_deadline)
+		return -1;
 
-		select(vpninfo->select_nfds, &rfds, &wfds, &efds, &tv);
+	now = vpn_time_ms();
+	if (now >= vpninfo->next_deadline)
+		return 0;
+	if (vpninfo->next_deadline - now > INT_MAX)
+		return INT_MAX;
+	return vpninfo->next_deadline - now;
+}
+
+int openconnect_process_events(struct openconnect_info *vpninfo)
+{
+	int timeout = INT_MAX;
+	int ret;
+
+	if (vpninfo->quit_reason)
+		return -EIO;
+
+	/* We aren't told which fds are ready, so just try everything;
+	   it's all non-blocking. The cmd pipe is too, but a legacy
+	   cancel fd might not be. */
+	if (vpninfo->cmd_fd_write != -1)
+		read_cmd_fd(vpninfo);
+	else if (vpninfo->cmd_fd != -1)
+		poll_cmd_fd(vpninfo, 0);
+
+	ret = handle_cmds(vpninfo);
+	if (ret > 0) {
+		/* Nothing more happens until we're called again */
+		vpninfo->next_deadline = 0;
+		return 0;
+	}
+	if (ret == 0)
+		ret = mainloop_pass(vpninfo, &timeout);
+	if (ret < 0) {
+		vpninfo->next_deadline = 0;
+		cstp_bye(vpninfo, vpninfo->quit_reason);
+		shutdown_tun(vpninfo);
+		return ret;
 	}
 
-	cstp_bye(vpninfo, vpninfo->quit_reason);
+	if (ret)
+		vpninfo->next_deadline = vpninfo->now;
+	else if (timeout == INT_MAX)
+		vpninfo->next_deadline = 0;
+	else
+		vpninfo->next_deadline = vpninfo->now + timeout;
 
-	shutdown_tun(vpninfo);
-	return ret < 0 ? ret : -EIO;
+	return ret ? 1 : 0;
+}
+
+/* Microseconds from an arbitrary starting point. Use the monotonic clock
+   where we can, so that changes to the wall clock don't make us think the
+   peer has died, or put off rekeying indefinitely. */
+uint64_t vpn_time_us(void)
+{
+	struct timeval tv;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* The same clock, in milliseconds */
+uint64_t vpn_time_ms(void)
+{
+	return vpn_time_us() / 1000;
+}
+
+/* Reduce the mainloop's timeout so that it wakes up at 'due' */
+void set_deadline(int *timeout, uint64_t due, uint64_t now)
+{
+	uint64_t left = due > now ? due - now : 0;
+
+	if ((uint64_t)*timeout > left)
+		*timeout = left;
 }
 
 /* Called when the socket is unwritable, to get the deadline for DPD.
+   'now' is from vpn_time_ms(), and *timeout is in ms.
    Returns 1 if DPD deadline has already arrived. */
-int ka_stalled_action(struct keepalive_info *ka, int *timeout)
+int ka_stalled_action(struct keepalive_info *ka, uint64_t now, int *timeout)
 {
-	time_t due, now = time(NULL);
+	uint64_t due;
 
 	if (ka->rekey) {
-		due = ka->last_rekey + ka->rekey;
+		due = ka->last_rekey + (uint64_t)ka->rekey * 1000;
 
 		if (now >= due)
 			return KA_REKEY;
 
-		if (*timeout > (due - now) * 1000)
-			*timeout = (due - now) * 1000;
+		set_deadline(timeout, due, now);
 	}
 
 	if (!ka->dpd)
 		return KA_NONE;
 
-	due = ka->last_rx + (2 * ka->dpd);
+	due = ka->last_rx + (2 * (uint64_t)ka->dpd * 1000);
 
 	if (now > due)
 		return KA_DPD_DEAD;
 
-	if (*timeout > (due - now) * 1000)
-		*timeout = (due - now) * 1000;
+	set_deadline(timeout, due, now);
 
 	return KA_NONE;
 }
 
 
-int keepalive_action(struct keepalive_info *ka, int *timeout)
+int keepalive_action(struct keepalive_info *ka, uint64_t now, int *timeout)
 {
-	time_t now = time(NULL);
-
 	if (ka->rekey) {
-		time_t due = ka->last_rekey + ka->rekey;
+		uint64_t due = ka->last_rekey + (uint64_t)ka->rekey * 1000;
 
 		if (now >= due)
 			return KA_REKEY;
 
-		if (*timeout > (due - now) * 1000)
-			*timeout = (due - now) * 1000;
+		set_deadline(timeout, due, now);
 	}
 
 	/* DPD is bidirectional -- PKT 3 out, PKT 4 back */
 	if (ka->dpd) {
-		time_t due = ka->last_rx + ka->dpd;
-		time_t overdue = ka->last_rx + (2 * ka->dpd);
+		uint64_t due = ka->last_rx + (uint64_t)ka->dpd * 1000;
+		uint64_t overdue = ka->last_rx + (2 * (uint64_t)ka->dpd * 1000);
 
 		/* Peer didn't respond */
 		if (now > overdue)
@@ -207,7 +696,7 @@ int keepalive_action(struct keepalive_info *ka, int *timeout)
 		/* If we already have DPD outstanding, don't flood. Repeat by
 		   all means, but only after half the DPD period. */
 		if (ka->last_dpd > ka->last_rx)
-			due = ka->last_dpd + ka->dpd / 2;
+			due = ka->last_dpd + (uint64_t)ka->dpd * 500;
 
 		/* We haven't seen a packet from this host for $DPD seconds.
 		   Prod it to see if it's still alive */
@@ -215,22 +704,179 @@ int keepalive_action(struct keepalive_info *ka, int *timeout)
 			ka->last_dpd = now;
 			return KA_DPD;
 		}
-		if (*timeout > (due - now) * 1000)
-			*timeout = (due - now) * 1000;
+		set_deadline(timeout, due, now);
 	}
 
 	/* Keepalive is just client -> server */
 	if (ka->keepalive) {
-		time_t due = ka->last_tx + ka->keepalive;
+		uint64_t due = ka->last_tx + (uint64_t)ka->keepalive * 1000;
 
 		/* If we haven't sent anything for $KEEPALIVE seconds, send a
 		   dummy packet (which the server will discard) */
 		if (now >= due)
 			return KA_KEEPALIVE;
 
-		if (*timeout > (due - now) * 1000)
-			*timeout = (due - now) * 1000;
+		set_deadline(timeout, due, now);
 	}
 
 	return KA_NONE;
 }
+
+struct openconnect_group *openconnect_group_new(void)
+{
+	struct openconnect_group *group = calloc(1, sizeof(*group));
+
+	if (!group)
+		return NULL;
+
+#ifdef HAVE_EPOLL
+	group->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (group->epoll_fd < 0) {
+		free(group);
+		return NULL;
+	}
+#endif
+	return group;
+}
+
+void openconnect_group_free(struct openconnect_group *group)
+{
+	while (group->nr_sessions)
+		openconnect_group_remove(group, group->sessions[0]);
+
+#ifdef HAVE_EPOLL
+	close(group->epoll_fd);
+#endif
+	free(group->sessions);
+	free(group);
+}
+
+/* Each session keeps its own epoll instance, which becomes readable
+   when any of the session's fds are ready. So the group only needs to
+   watch one fd per session, and never has to track the individual fds
+   coming and going as the session reconnects. */
+int openconnect_group_add(struct openconnect_group *group,
+			  struct openconnect_info *vpninfo)
+{
+#ifdef HAVE_EPOLL
+	struct epoll_event ev;
+
+	if (vpninfo->group)
+		return -EBUSY;
+
+	setup_epoll(vpninfo);
+	if (vpninfo->epoll_fd == -1) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Cannot add session to group without epoll\n"));
+		return -EINVAL;
+	}
+
+	if (group->nr_sessions == group->max_sessions) {
+		int max = group->max_sessions ? group->max_sessions * 2 : 16;
+		struct openconnect_info **sessions;
+
+		sessions = realloc(group->sessions, max * sizeof(*sessions));
+		if (!sessions)
+			return -ENOMEM;
+		group->sessions = sessions;
+		group->max_sessions = max;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = vpninfo;
+	if (epoll_ctl(group->epoll_fd, EPOLL_CTL_ADD, vpninfo->epoll_fd, &ev) < 0)
+		return -errno;
+
+	group->sessions[group->nr_sessions++] = vpninfo;
+	vpninfo->group = group;
+	/* Run it at the next opportunity */
+	vpninfo->next_deadline = vpn_time_ms();
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+void openconnect_group_remove(struct openconnect_group *group,
+			      struct openconnect_info *vpninfo)
+{
+	int i;
+
+	if (vpninfo->group != group)
+		return;
+
+	for (i = 0; i < group->nr_sessions; i++) {
+		if (group->sessions[i] == vpninfo) {
+			group->sessions[i] = group->sessions[--group->nr_sessions];
+			break;
+		}
+	}
+#ifdef HAVE_EPOLL
+	epoll_ctl(group->epoll_fd, EPOLL_CTL_DEL, vpninfo->epoll_fd, NULL);
+#endif
+	vpninfo->group = NULL;
+}
+
+int openconnect_group_run(struct openconnect_group *group,
+			  struct openconnect_info **ended)
+{
+	*ended = NULL;
+
+#ifdef HAVE_EPOLL
+	while (group->nr_sessions) {
+		struct epoll_event evs[64];
+		uint64_t now, next = 0;
+		int i, nfds, timeout;
+
+		for (i = 0; i < group->nr_sessions; i++) {
+			struct openconnect_info *vpninfo = group->sessions[i];
+
+			if (vpninfo->next_deadline &&
+			    (!next || vpninfo->next_deadline < next))
+				next = vpninfo->next_deadline;
+		}
+
+		now = vpn_time_ms();
+		if (!next)
+			timeout = -1;
+		else if (next <= now)
+			timeout = 0;
+		else if (next - now > INT_MAX)
+			timeout = INT_MAX;
+		else
+			timeout = next - now;
+
+		nfds = epoll_wait(group->epoll_fd, evs, 64, timeout);
+		for (i = 0; i < nfds; i++)
+			((struct openconnect_info *)evs[i].data.ptr)->group_ready = 1;
+
+		now = vpn_time_ms();
+		for (i = 0; i < group->nr_sessions; i++) {
+			struct openconnect_info *vpninfo = group->sessions[i];
+			int ret;
+
+			if (!vpninfo->group_ready &&
+			    (!vpninfo->next_deadline || vpninfo->next_deadline > now))
+				continue;
+
+			vpninfo->group_ready = 0;
+			ret = openconnect_process_events(vpninfo);
+			if (ret >= 0 && vpninfo->ssl_fd == -1)
+				/* Paused, or needs to reconnect */
+				ret = -EAGAIN;
+			else if (ret >= 0 && vpninfo->epoll_fd == -1)
+				/* It fell back to select(); the group can't see it */
+				ret = -EOPNOTSUPP;
+			if (ret < 0) {
+				openconnect_group_remove(group, vpninfo);
+				*ended = vpninfo;
+				return ret;
+			}
+		}
+	}
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
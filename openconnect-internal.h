@@ -60,6 +60,17 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_KTLS
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+
 #ifdef LIBPROXY_HDR
 #include LIBPROXY_HDR
 #endif
@@ -84,29 +95,184 @@
 
 /****************************************************************************/
 
+/* The packet occupies len bytes from data, somewhere within buf[]. The
+   space before it (headroom) and after it (tailroom) is for adding
+   headers and trailers in place, with pkt_push() and pkt_put(). */
 struct pkt {
 	int len;
+	int alloc_len;	/* Size of buf[] */
+	uint64_t queued;	/* vpn_time_ms() when it was queued for sending */
 	struct pkt *next;
-	unsigned char hdr[8];
-	unsigned char data[];
+	unsigned char *data;
+	unsigned char buf[];
+};
+
+/* The defaults, and minimums, for vpninfo->pkt_headroom and pkt_tailroom.
+   Enough for the STF header, which is more than the DTLS type byte
+   or the tun AF prefix need. */
+#define PKT_HEADROOM	8
+/* The adler32 trailer on compressed packets, and then some for the
+   worst case expansion of deflating a whole packet. */
+#define PKT_TAILROOM	(4 + 32)
+
+/* Prepend len bytes to the packet, returning the new start */
+static inline unsigned char *pkt_push(struct pkt *pkt, int len)
+{
+	pkt->data -= len;
+	pkt->len += len;
+	return pkt->data;
+}
+
+/* Remove len bytes from the start of the packet */
+static inline unsigned char *pkt_pull(struct pkt *pkt, int len)
+{
+	pkt->data += len;
+	pkt->len -= len;
+	return pkt->data;
+}
+
+/* Append len bytes to the packet, returning where they go */
+static inline unsigned char *pkt_put(struct pkt *pkt, int len)
+{
+	unsigned char *tail = pkt->data + pkt->len;
+
+	pkt->len += len;
+	return tail;
+}
+
+static inline int pkt_tailroom(struct pkt *pkt)
+{
+	return pkt->alloc_len - (pkt->data - pkt->buf) - pkt->len;
+}
+
+/* Packets are queued and dequeued in constant time. 'bytes' is the
+   sum of the payload lengths, which must not change while queued. */
+struct pkt_queue {
+	struct pkt *head;
+	struct pkt *tail;
+	int count;
+	int bytes;
 };
 
+static inline void queue_packet(struct pkt_queue *q, struct pkt *new)
+{
+	new->next = NULL;
+	if (q->tail)
+		q->tail->next = new;
+	else
+		q->head = new;
+	q->tail = new;
+	q->count++;
+	q->bytes += new->len;
+}
+
+/* Put a packet back at the head of the queue, if it couldn't be sent */
+static inline void requeue_packet(struct pkt_queue *q, struct pkt *new)
+{
+	new->next = q->head;
+	q->head = new;
+	if (!q->tail)
+		q->tail = new;
+	q->count++;
+	q->bytes += new->len;
+}
+
+/* Put all the packets from 'from' back at the head of q, in order */
+static inline void requeue_packets(struct pkt_queue *q, struct pkt_queue *from)
+{
+	if (!from->head)
+		return;
+
+	from->tail->next = q->head;
+	q->head = from->head;
+	if (!q->tail)
+		q->tail = from->tail;
+	q->count += from->count;
+	q->bytes += from->bytes;
+
+	from->head = from->tail = NULL;
+	from->count = from->bytes = 0;
+}
+
+static inline struct pkt *dequeue_packet(struct pkt_queue *q)
+{
+	struct pkt *ret = q->head;
+
+	if (ret) {
+		q->head = ret->next;
+		if (!q->head)
+			q->tail = NULL;
+		q->count--;
+		q->bytes -= ret->len;
+		ret->next = NULL;
+	}
+	return ret;
+}
+
 #define KA_NONE		0
 #define KA_DPD		1
 #define KA_DPD_DEAD	2
 #define KA_KEEPALIVE	3
 #define KA_REKEY	4
 
+/* X-CSTP-Rekey-Method and X-DTLS-Rekey-Method */
+#define REKEY_NONE	0
+#define REKEY_TUNNEL	1	/* "new-tunnel": reconnect */
+#define REKEY_SSL	2	/* "ssl": rehandshake in place */
+
+/* Intervals are in seconds, as given by the server. Timestamps are in
+   milliseconds from vpn_time_ms(). */
 struct keepalive_info {
 	int dpd;
 	int keepalive;
 	int rekey;
-	time_t last_rekey;
-	time_t last_tx;
-	time_t last_rx;
-	time_t last_dpd;
+	int rekey_method;
+	uint64_t last_rekey;
+	uint64_t last_tx;
+	uint64_t last_rx;
+	uint64_t last_dpd;
+};
+
+/* DTLS packetization layer path MTU discovery (RFC 8899). Sizes are
+   tunnel MTUs, probed with DPD requests padded out to that size. */
+struct pmtu_info {
+	int mtu;		/* Largest size the path has carried, or zero */
+	int lo, hi;		/* Search range; lo is known to work (or zero) */
+	int next;		/* Size to probe next, or zero when done */
+	int probe;		/* Size of the probe in flight, or zero */
+	int tries;
+	int kernel_mtu;		/* Last path MTU the kernel reported */
+	uint64_t probe_sent;
+	uint64_t next_search;	/* When to look for a bigger MTU, or zero */
+	uint64_t last_check;	/* ... and for a smaller one */
+};
+
+#define DTLS_PMTU_BASE		1280	/* Search from here if the top fails */
+#define DTLS_PMTU_STEP		16	/* Stop when the range is this narrow */
+#define DTLS_PMTU_TRIES		3
+#define DTLS_PMTU_TIMEOUT	2000	/* Per probe, in ms */
+#define DTLS_PMTU_RAISE		600000	/* Try for a bigger MTU this often */
+#define DTLS_PMTU_CHECK		1000	/* Look at the kernel's idea this often */
+
+/* How well each class of outgoing packet has been compressing lately.
+   A class which doesn't is sent uncompressed, except for one packet in
+   every COMPR_PROBE_INTERVAL to see if that's changed. */
+struct compr_class {
+	unsigned long in;	/* Bytes compressed, decaying */
+	unsigned long out;	/* ... and what they compressed to */
+	int bypass;
+	int probe;		/* Packets bypassed since the last probe */
 };
 
+#define COMPR_PROBE_INTERVAL	32
+#define COMPR_MIN_SAMPLE	16384	/* Bytes before judging a class */
+#define COMPR_WINDOW		65536	/* Bytes before halving in and out */
+
+#define COMPR_DEFAULT_LEVEL	6	/* What Z_DEFAULT_COMPRESSION means */
+#define COMPR_CPU_BUDGET	20	/* Percent */
+#define COMPR_ADJUST_INTERVAL	1000	/* ms */
+#define COMPR_SUSPEND_TIME	30000	/* ms before trying again */
+
 struct pin_cache {
 	struct pin_cache *next;
 	char *token;
@@ -121,6 +287,46 @@ struct pin_cache {
 #define CERT_TYPE_PKCS12	2
 #define CERT_TYPE_TPM		3
 
+/* Events we may want to be woken for on a file descriptor. With select()
+   these are the three fd_sets; with epoll they are EPOLLIN, EPOLLOUT and
+   EPOLLPRI respectively. */
+#define FD_EV_READ	1
+#define FD_EV_WRITE	2
+#define FD_EV_EXCEPT	4
+
+/* How long to wait for a DTLS handshake to complete, in ms */
+#define DTLS_HANDSHAKE_TIMEOUT	5000
+
+/* How long the outgoing queue must have been standing, without
+   emptying, before we take that as a sign that its limit is too high. */
+#define TX_SLACK_HOLD_TIME	1000
+
+/* When sending over CSTP, queued packets are coalesced into a single TLS
+   record of up to this many bytes of STF frames. */
+#define CSTP_TX_BATCH_SIZE	16384
+
+/* How long resolved addresses are cached for, in ms. getaddrinfo()
+   doesn't tell us the TTLs, so it's the same for all of them. */
+#define RESOLVE_CACHE_TIME	60000
+
+/* How long an in-place CSTP rekey may take before we reconnect instead */
+#define CSTP_REKEY_TIMEOUT	10000
+
+/* Size of the CSTP reassembly buffer; enough for the largest STF frame */
+#define CSTP_RX_BUF_SIZE	(8 + 65535)
+
+/* tun, ssl, dtls, new_dtls and cmd, with some room to spare */
+#define MAX_MONITORED_FDS	8
+
+/* While there is work to do on every pass, the mainloop doesn't wait for
+   events at all. Check cmd_fd (with a zero timeout) at least this often. */
+#define CMD_POLL_PASSES		32
+
+struct monitored_fd {
+	int fd;
+	int events;
+};
+
 #define REDIR_TYPE_NONE		0
 #define REDIR_TYPE_NEWHOST	1
 #define REDIR_TYPE_LOCAL	2
@@ -170,6 +376,7 @@ struct openconnect_info {
 	int nopasswd;
 	int xmlpost;
 	char *dtls_ciphers;
+	char *tls_priority;
 	uid_t uid_csd;
 	char *csd_wrapper;
 	int uid_csd_given;
@@ -196,12 +403,19 @@ struct openconnect_info {
 	struct oc_vpn_option *cstp_options;
 	struct oc_vpn_option *dtls_options;
 
+	/* The server that https_resume, the last TLS session, was with */
+	char *https_resume_host;
+	int https_resume_port;
+	/* That server only talks TLS 1.0 with the old cipher suites */
+	int tls_legacy;
 #if defined(OPENCONNECT_OPENSSL)
 	X509 *cert_x509;
 	SSL_CTX *https_ctx;
 	SSL *https_ssl;
+	SSL_SESSION *https_resume;
 #elif defined(OPENCONNECT_GNUTLS)
 	gnutls_session_t https_sess;
+	gnutls_datum_t https_resume;
 	gnutls_certificate_credentials_t https_cred;
 	struct pin_cache *pin_cache;
 #ifdef HAVE_TROUSERS
@@ -223,20 +437,59 @@ struct openconnect_info {
 #endif /* OPENCONNECT_GNUTLS */
 	struct keepalive_info ssl_times;
 	int owe_ssl_dpd_response;
-	struct pkt *deflate_pkt;
 	struct pkt *current_ssl_pkt;
-	struct pkt *pending_deflated_pkt;
+	/* When current_ssl_pkt holds frames built from queued packets
+	   (compressed, or coalesced), the original packets. They are
+	   requeued if the connection is lost before it's sent. */
+	struct pkt_queue pending_ssl_pkts;
+	/* Buffer in which STF frames are coalesced for sending */
+	struct pkt *cstp_tx_batch;
+	/* Receive buffer, kept for the next record if it wasn't queued */
+	struct pkt *cstp_pkt;
+	/* Reassembly buffer, for records that don't hold exactly one frame */
+	unsigned char *cstp_rx_buf;
+	int cstp_rx_len;
+	/* While a rehandshake is being driven, when it started. With
+	   GnuTLS only it may use the TLS session, unless cstp_rekey_rx is
+	   set to say that there is application data to be read in the
+	   middle of it. */
+	uint64_t cstp_rekey_start;
+	int cstp_rekey_rx;
+	/* The kernel is doing the TLS record encryption for CSTP. For GnuTLS,
+	   ktls_tx and ktls_rx say that cstp_write() and cstp_read() must use
+	   the socket directly, and ktls_tx_sent is how much of the partially
+	   sent ktls_tx_buf has gone already. */
+	int ktls_active;
+	int ktls_tx;
+	int ktls_rx;
+	int ktls_tx_sent;
+	const void *ktls_tx_buf;
 
 	z_stream inflate_strm;
 	uint32_t inflate_adler32;
 	z_stream deflate_strm;
 	uint32_t deflate_adler32;
+	struct compr_class compr_class[OC_COMPR_CLASSES];
+	/* Adaptive compression level; see compr_adjust() */
+	int compr_level;	/* deflate level, or 0 while suspended */
+	int compr_new_level;	/* To be set before the next deflate() */
+	int compr_cpu_budget;	/* Percent of the time deflate() may take */
+	uint64_t compr_period_start;
+	uint64_t compr_resume;	/* Not before this, once suspended */
+	uint64_t compr_period_us;	/* Time spent in deflate() */
+	unsigned long compr_period_in;
+	unsigned long compr_period_out;
+	unsigned long cstp_period_tx;	/* Bytes written to the connection */
+	int cstp_period_stalled;	/* ... and whether it ever filled up */
 
 	int disable_ipv6;
 	int reconnect_timeout;
 	int reconnect_interval;
 	int dtls_attempt_period;
-	time_t new_dtls_started;
+	uint64_t new_dtls_started;
+	/* A background DTLS rekey failed, so the next one reconnects instead,
+	   whatever dtls_times.rekey_method says. Cleared by each CONNECT. */
+	int dtls_rekey_tunnel;
 #if defined(DTLS_OPENSSL)
 	SSL_CTX *dtls_ctx;
 	SSL *dtls_ssl;
@@ -251,7 +504,13 @@ struct openconnect_info {
 	gnutls_session_t dtls_ssl;
 	gnutls_session_t new_dtls_ssl;
 #endif
+	/* Batched datagram I/O for each of the above */
+	struct dtls_io *dtls_io;
+	struct dtls_io *new_dtls_io;
 	struct keepalive_info dtls_times;
+	struct pmtu_info dtls_pmtu;
+	/* Receive buffer, kept for the next packet if it wasn't used */
+	struct pkt *dtls_pkt;
 	unsigned char dtls_session_id[32];
 	unsigned char dtls_secret[48];
 
@@ -259,16 +518,35 @@ struct openconnect_info {
 	char *vpnc_script;
 	int script_tun;
 	char *ifname;
+	/* Receive buffer, kept for the next packet if it wasn't used */
+	struct pkt *tun_pkt;
+	int tun_complained;
 
 	int reqmtu, basemtu;
 	const char *banner;
 
 	struct oc_ip_info ip_info;
 
+	/* Every fd the mainloop waits on, with the events of interest. The
+	   fd_sets below are kept in sync for the select() fallback; when
+	   epoll_fd is valid it is the one we actually sleep on. */
+	int nr_monitored_fds;
+	struct monitored_fd monitored_fds[MAX_MONITORED_FDS];
+#ifdef HAVE_EPOLL
+	int epoll_fd;
+#endif
 	int select_nfds;
 	fd_set select_rfds;
 	fd_set select_wfds;
 	fd_set select_efds;
+	/* Consecutive mainloop passes which found work to do, without
+	   going back to the main wait to look at cmd_fd */
+	int busy_passes;
+	/* vpn_time_ms() at the start of the current mainloop pass */
+	uint64_t now;
+	/* When openconnect_process_events() next needs to be called,
+	   or zero if only an fd event will give it anything to do */
+	uint64_t next_deadline;
 
 #ifdef __sun__
 	int ip_fd;
@@ -284,14 +562,26 @@ struct openconnect_info {
 	int got_cancel_cmd;
 	int got_pause_cmd;
 
-	struct pkt *incoming_queue;
-	struct pkt *outgoing_queue;
-	int outgoing_qlen;
+	struct pkt_queue incoming_queue;
+	struct pkt_queue outgoing_queue;
+	/* Spare packets, so we don't hit malloc() for every one */
+	struct pkt_queue free_pkts;
+	int pkt_headroom;
+	int pkt_tailroom;
 	int max_qlen;
+	/* Outgoing queue limit in bytes, adjusted by update_tx_queue_limit() */
+	int tx_qlimit;
+	int tx_slack_min;
+	uint64_t tx_slack_start;
+	int tx_sojourn_avg8;	/* Average time in queue (ms), times 8 */
 	struct oc_stats stats;
 	openconnect_stats_vfn stats_handler;
 
 	socklen_t peer_addrlen;
+	/* Address of the last successful connection, to be tried first */
+	struct sockaddr_storage preferred_addr;
+	socklen_t preferred_addrlen;
+	struct resolved_host *resolve_cache;
 	struct sockaddr *peer_addr;
 	struct sockaddr *dtls_addr;
 
@@ -308,6 +598,19 @@ struct openconnect_info {
 	openconnect_process_auth_form_vfn process_auth_form;
 	openconnect_progress_vfn progress;
 	openconnect_protect_socket_vfn protect_socket;
+
+	/* The openconnect_group which is running this session, if any */
+	struct openconnect_group *group;
+	int group_ready;
+};
+
+struct openconnect_group {
+	struct openconnect_info **sessions;
+	int nr_sessions;
+	int max_sessions;
+#ifdef HAVE_EPOLL
+	int epoll_fd;
+#endif
 };
 
 #if (defined(DTLS_OPENSSL) && defined(SSL_OP_CISCO_ANYCONNECT)) || \
@@ -359,6 +662,7 @@ char *openconnect__strcasestr(const char *haystack, const char *needle);
 /* tun.c */
 int tun_mainloop(struct openconnect_info *vpninfo, int *timeout);
 void shutdown_tun(struct openconnect_info *vpninfo);
+int set_tun_mtu(struct openconnect_info *vpninfo, int mtu);
 int script_config_tun(struct openconnect_info *vpninfo, const char *reason);
 
 /* dtls.c */
@@ -390,15 +694,20 @@ const char *keystore_strerror(int err);
 int keystore_fetch(const char *key, unsigned char **result);
 #endif
 void cmd_fd_set(struct openconnect_info *vpninfo, fd_set *fds, int *maxfd);
+void read_cmd_fd(struct openconnect_info *vpninfo);
 void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds);
 int is_cancel_pending(struct openconnect_info *vpninfo, fd_set *fds);
 void poll_cmd_fd(struct openconnect_info *vpninfo, int timeout);
+void free_resolve_cache(struct openconnect_info *vpninfo);
+int can_resume_https(struct openconnect_info *vpninfo);
+int set_https_resume_host(struct openconnect_info *vpninfo);
 
 /* {gnutls,openssl}.c */
 int openconnect_SSL_gets(struct openconnect_info *vpninfo, char *buf, size_t len);
 int openconnect_SSL_write(struct openconnect_info *vpninfo, char *buf, size_t len);
 int openconnect_SSL_read(struct openconnect_info *vpninfo, char *buf, size_t len);
 int openconnect_open_https(struct openconnect_info *vpninfo);
+void openconnect_setup_ktls(struct openconnect_info *vpninfo);
 void openconnect_close_https(struct openconnect_info *vpninfo, int final);
 int get_cert_md5_fingerprint(struct openconnect_info *vpninfo, OPENCONNECT_X509 *cert,
 			     char *buf);
@@ -413,11 +722,28 @@ int openconnect_local_cert_md5(struct openconnect_info *vpninfo,
 #endif
 
 /* mainloop.c */
-int vpn_add_pollfd(struct openconnect_info *vpninfo, int fd, short events);
-int queue_new_packet(struct pkt **q, void *buf, int len);
-void queue_packet(struct pkt **q, struct pkt *new);
-int keepalive_action(struct keepalive_info *ka, int *timeout);
-int ka_stalled_action(struct keepalive_info *ka, int *timeout);
+void monitor_fd_events(struct openconnect_info *vpninfo, int fd, int set, int clear);
+int monitored_fd_events(struct openconnect_info *vpninfo, int fd);
+void unmonitor_fd(struct openconnect_info *vpninfo, int fd);
+#define monitor_read_fd(_v, _fd)	monitor_fd_events(_v, _fd, FD_EV_READ, 0)
+#define monitor_write_fd(_v, _fd)	monitor_fd_events(_v, _fd, FD_EV_WRITE, 0)
+#define monitor_except_fd(_v, _fd)	monitor_fd_events(_v, _fd, FD_EV_EXCEPT, 0)
+#define unmonitor_read_fd(_v, _fd)	monitor_fd_events(_v, _fd, 0, FD_EV_READ)
+#define unmonitor_write_fd(_v, _fd)	monitor_fd_events(_v, _fd, 0, FD_EV_WRITE)
+#define is_read_fd_monitored(_v, _fd)	(monitored_fd_events(_v, _fd) & FD_EV_READ)
+struct pkt *alloc_pkt(struct openconnect_info *vpninfo, int len);
+struct pkt *get_rx_pkt(struct openconnect_info *vpninfo, struct pkt **cache, int len);
+void free_pkt(struct openconnect_info *vpninfo, struct pkt *pkt);
+void update_tx_queue_limit(struct openconnect_info *vpninfo);
+void tx_pkt_sent(struct openconnect_info *vpninfo, struct pkt *pkt);
+int queue_new_packet(struct openconnect_info *vpninfo, struct pkt_queue *q,
+		     void *buf, int len);
+void free_pkt_queue(struct pkt_queue *q);
+uint64_t vpn_time_ms(void);
+uint64_t vpn_time_us(void);
+void set_deadline(int *timeout, uint64_t due, uint64_t now);
+int keepalive_action(struct keepalive_info *ka, uint64_t now, int *timeout);
+int ka_stalled_action(struct keepalive_info *ka, uint64_t now, int *timeout);
 
 /* xml.c */
 int config_lookup_host(struct openconnect_info *vpninfo, const char *host);
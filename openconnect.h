@@ -30,11 +30,30 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <poll.h>
 
 #define OPENCONNECT_API_VERSION_MAJOR 3
-#define OPENCONNECT_API_VERSION_MINOR 1
+#define OPENCONNECT_API_VERSION_MINOR 2
 
 /*
+ * API version 3.2:
+ *  - Add openconnect_get_pollfds(), openconnect_get_next_timeout(),
+ *    openconnect_process_events()
+ *  - Add openconnect_group_new(), openconnect_group_free(),
+ *    openconnect_group_add(), openconnect_group_remove(),
+ *    openconnect_group_run()
+ *  - Add pool_hits, pool_misses, tx_queue_limit, tx_queue_bytes,
+ *    tx_sojourn_avg_ms and tx_sojourn_max_ms to struct oc_stats
+ *  - Add openconnect_preresolve_host()
+ *  - Add openconnect_set_tls_priority()
+ *  - Add compr_in_bytes, compr_out_bytes, compr_bypass_bytes, compr_level,
+ *    compr_cpu_pct, cstp_link_rate and compr_level_changes to struct oc_stats
+ *  - Add openconnect_set_compression_cpu_budget()
+ *  - Add dtls_connect_attempts, dtls_connect_failures, dtls_switchovers,
+ *    dtls_switchover_ms and dtls_cstp_fallbacks to struct oc_stats
+ *  - Add dtls_pmtu and dtls_pmtu_probes to struct oc_stats
+ *  - Add openconnect_set_pkt_room()
+ *
  * API version 3.1:
  *  - Add openconnect_setup_cmd_pipe(), openconnect_mainloop(),
  *    openconnect_setup_tun_device(), openconnect_setup_tun_script(),
@@ -197,11 +216,53 @@ struct oc_vpn_option {
 	struct oc_vpn_option *next;
 };
 
+/* Classes of outgoing traffic, by how well it's likely to compress */
+#define OC_COMPR_CLASS_ENCRYPTED	0	/* TLS, SSH, ESP, QUIC... */
+#define OC_COMPR_CLASS_RANDOM		1	/* Looks random when sampled */
+#define OC_COMPR_CLASS_OTHER		2
+#define OC_COMPR_CLASSES		3
+
 struct oc_stats {
 	uint64_t tx_pkts;
 	uint64_t tx_bytes;
 	uint64_t rx_pkts;
 	uint64_t rx_bytes;
+	/* Added in API version 3.2 */
+	uint64_t pool_hits;
+	uint64_t pool_misses;
+	uint64_t tx_queue_limit;	/* bytes */
+	uint64_t tx_queue_bytes;
+	uint64_t tx_sojourn_avg_ms;
+	uint64_t tx_sojourn_max_ms;
+	/* CSTP compression, for each OC_COMPR_CLASS_*: the bytes of packets
+	   that were compressed, what they compressed to, and the bytes of
+	   packets which were sent uncompressed as not worth the effort */
+	uint64_t compr_in_bytes[OC_COMPR_CLASSES];
+	uint64_t compr_out_bytes[OC_COMPR_CLASSES];
+	uint64_t compr_bypass_bytes[OC_COMPR_CLASSES];
+	/* The deflate level in use, or zero while compression is suspended,
+	   and the percentage of the time spent compressing at the last
+	   adjustment. cstp_link_rate is how fast the CSTP connection has
+	   been draining when it was the bottleneck, in bytes per second,
+	   or zero if it hasn't been. */
+	uint64_t compr_level;
+	uint64_t compr_cpu_pct;
+	uint64_t cstp_link_rate;
+	uint64_t compr_level_changes;
+	/* DTLS handshakes started and failed, the number of times a new
+	   session took over from one which carried the traffic while it
+	   was being set up, and how long the last such handshake took.
+	   dtls_cstp_fallbacks counts the times the DTLS session died and
+	   traffic had to go over CSTP until it was replaced. */
+	uint64_t dtls_connect_attempts;
+	uint64_t dtls_connect_failures;
+	uint64_t dtls_switchovers;
+	uint64_t dtls_switchover_ms;
+	uint64_t dtls_cstp_fallbacks;
+	/* The DTLS path MTU found by probing, or zero if not yet known,
+	   and the number of probes sent to find it */
+	uint64_t dtls_pmtu;
+	uint64_t dtls_pmtu_probes;
 };
 
 /****************************************************************************/
@@ -268,6 +329,12 @@ int openconnect_set_stoken_mode(struct openconnect_info *, int, const char *);
 void openconnect_set_xmlsha1(struct openconnect_info *, const char *, int size);
 
 void openconnect_set_cafile(struct openconnect_info *, char *);
+/* A GnuTLS priority string, or an OpenSSL cipher list, to use for the
+   HTTPS connection in place of the default. Without one, TLS 1.2 and
+   later with AEAD ciphers are preferred, falling back to the TLS 1.0
+   settings that old servers need if the handshake fails. Pass NULL for
+   the default. */
+void openconnect_set_tls_priority(struct openconnect_info *, char *);
 void openconnect_setup_csd(struct openconnect_info *, uid_t, int silent, char *wrapper);
 void openconnect_set_xmlpost(struct openconnect_info *, int enable);
 
@@ -284,6 +351,15 @@ void openconnect_set_client_cert(struct openconnect_info *, char *cert, char *ss
 void openconnect_set_server_cert_sha1(struct openconnect_info *, char *);
 const char *openconnect_get_ifname(struct openconnect_info *);
 void openconnect_set_reqmtu(struct openconnect_info *, int reqmtu);
+/* The deflate level is adjusted to keep the time spent compressing within
+   this percentage of the total, and compression is suspended when it can't
+   keep up with the connection. The default is 20. */
+void openconnect_set_compression_cpu_budget(struct openconnect_info *, int percent);
+/* Space to leave before and after each packet's data, so that headers
+   and trailers can be added in place. It can only be increased from the
+   default, which is what the VPN protocols themselves need, and must be
+   set before the connection is made. Returns -EINVAL if it's too small. */
+int openconnect_set_pkt_room(struct openconnect_info *, int headroom, int tailroom);
 
 /* The returned structures are owned by the library and may be freed/replaced
    due to rekey or reconnect. Assume that once the mainloop starts, the
@@ -306,6 +382,14 @@ void openconnect_clear_cookie(struct openconnect_info *);
 
 void openconnect_reset_ssl(struct openconnect_info *vpninfo);
 int openconnect_parse_url(struct openconnect_info *vpninfo, char *url);
+
+/* Start looking up the addresses of a host in the background, for example
+   one that the user may be about to pick while an auth form is shown.
+   The port may be zero for the default. Addresses are cached for a while
+   whether or not they were looked up in advance. This returns -EOPNOTSUPP
+   where the platform has no asynchronous resolver. */
+int openconnect_preresolve_host(struct openconnect_info *vpninfo,
+				const char *host, int port);
 void openconnect_set_cert_expiry_warning(struct openconnect_info *vpninfo,
 					 int seconds);
 
@@ -350,6 +434,62 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			 int reconnect_timeout,
 			 int reconnect_interval);
 
+/* Alternatively, the caller can drive the connection from its own event
+   loop instead of calling openconnect_mainloop(). After setting up the
+   connection as above, wait for events on the file descriptors returned
+   by openconnect_get_pollfds(), or for openconnect_get_next_timeout()
+   milliseconds, and then call openconnect_process_events(). Both of the
+   former may change after each call to openconnect_process_events().
+
+   openconnect_get_pollfds() fills in up to nr_fds entries in fds[], and
+   returns the number of fds it wanted to fill in. No more than eight fds
+   will be used. openconnect_get_next_timeout() returns -1 if there is no
+   timeout, and zero if openconnect_process_events() has more work to do
+   immediately.
+
+   openconnect_process_events() returns a positive value if it did some
+   work, zero if there was nothing to do, or a negative error as for
+   openconnect_mainloop() if the session has ended. It does not block,
+   except while reconnecting to the server; the reconnect timeout and
+   interval are 300 and 10 seconds unless openconnect_mainloop() has
+   been called with others. */
+int openconnect_get_pollfds(struct openconnect_info *vpninfo,
+			    struct pollfd *fds, int nr_fds);
+int openconnect_get_next_timeout(struct openconnect_info *vpninfo);
+int openconnect_process_events(struct openconnect_info *vpninfo);
+
+/* A group runs many sessions from a single thread. Set up each session
+   as for openconnect_mainloop(), then add it to the group. A session can
+   only be in one group at a time; sessions in different groups share no
+   state, so they can be run from separate threads.
+
+   openconnect_group_run() runs until one of the sessions ends, at which
+   point it removes that session from the group, stores it in *ended and
+   returns its error code as openconnect_mainloop() would. The caller can
+   then free it, or set it up again and re-add it, before calling
+   openconnect_group_run() again. It returns zero (with *ended set to
+   NULL) when the group is empty.
+
+   Reconnecting to the server blocks, so a session which is paused or
+   needs to reconnect is removed from the group in the same way, with
+   -EAGAIN. Call openconnect_process_events() or openconnect_mainloop()
+   on it, perhaps from another thread, to reconnect; then add it back.
+   A session which can no longer use epoll is removed with -EOPNOTSUPP,
+   and can carry on with openconnect_mainloop() on its own.
+
+   Sessions are cancelled, paused or asked for stats through their own
+   cmd pipes, as with openconnect_mainloop(). Groups require epoll, and
+   openconnect_group_add() fails if the session can't use it. */
+struct openconnect_group;
+struct openconnect_group *openconnect_group_new(void);
+void openconnect_group_free(struct openconnect_group *group);
+int openconnect_group_add(struct openconnect_group *group,
+			  struct openconnect_info *vpninfo);
+void openconnect_group_remove(struct openconnect_group *group,
+			      struct openconnect_info *vpninfo);
+int openconnect_group_run(struct openconnect_group *group,
+			  struct openconnect_info **ended);
+
 /* The first (privdata) argument to each of these functions is either
    the privdata argument provided to openconnect_vpninfo_new_with_cbdata(),
    or if that argument was NULL then it'll be the vpninfo itself. */
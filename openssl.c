@@ -1248,6 +1248,42 @@ static int check_certificate_expiry(struct openconnect_info *vpninfo)
 	}
 	return 0;
 }
+/* What older Cisco ASA releases need: TLS 1.0 only */
+static void set_legacy_tls(SSL *ssl)
+{
+#ifdef SSL_MODE_SEND_FALLBACK_SCSV
+	/* Tell a server which could have done better that someone is
+	   forcing the downgrade */
+	SSL_set_mode(ssl, SSL_MODE_SEND_FALLBACK_SCSV);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_set_max_proto_version(ssl, TLS1_VERSION);
+	/* Newer OpenSSL won't do TLS 1.0 at all at the default level */
+	SSL_set_security_level(ssl, 0);
+#else
+#ifdef SSL_OP_NO_TLSv1_1
+	SSL_set_options(ssl, SSL_OP_NO_TLSv1_1);
+#endif
+#ifdef SSL_OP_NO_TLSv1_2
+	SSL_set_options(ssl, SSL_OP_NO_TLSv1_2);
+#endif
+#endif
+}
+
+/* Old ASAs reject a modern ClientHello with one of these. Anything else,
+   like a reset connection or a certificate we didn't like, doesn't
+   justify a downgrade. */
+static int is_tls_version_alert(void)
+{
+	unsigned long err = ERR_peek_error();
+
+	if (ERR_GET_LIB(err) != ERR_LIB_SSL)
+		return 0;
+
+	return ERR_GET_REASON(err) == SSL_R_TLSV1_ALERT_PROTOCOL_VERSION ||
+		ERR_GET_REASON(err) == SSL_R_SSLV3_ALERT_HANDSHAKE_FAILURE;
+}
+
 int openconnect_open_https(struct openconnect_info *vpninfo)
 {
 	method_const SSL_METHOD *ssl3_method;
@@ -1264,13 +1300,22 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		vpninfo->peer_cert = NULL;
 	}
 
+	/* Only stick with the legacy settings for the server that needed them */
+	if (!can_resume_https(vpninfo))
+		vpninfo->tls_legacy = 0;
+
+ retry:
 	ssl_sock = connect_https_socket(vpninfo);
 	if (ssl_sock < 0)
 		return ssl_sock;
 
-	ssl3_method = TLSv1_client_method();
+	/* Despite the name, this negotiates the highest TLS version that
+	   both sides support. */
+	ssl3_method = SSLv23_client_method();
 	if (!vpninfo->https_ctx) {
 		vpninfo->https_ctx = SSL_CTX_new(ssl3_method);
+		SSL_CTX_set_options(vpninfo->https_ctx,
+				    SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
 
 		/* Some servers (or their firewalls) really don't like seeing
 		   extensions. */
@@ -1362,6 +1407,29 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	https_ssl = SSL_new(vpninfo->https_ctx);
 	workaround_openssl_certchain_bug(vpninfo, https_ssl);
 
+	if (vpninfo->tls_priority) {
+		if (!SSL_set_cipher_list(https_ssl, vpninfo->tls_priority)) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to set TLS cipher list '%s'\n"),
+				     vpninfo->tls_priority);
+			openconnect_report_ssl_errors(vpninfo);
+			SSL_free(https_ssl);
+			close(ssl_sock);
+			return -EINVAL;
+		}
+	} else if (vpninfo->tls_legacy)
+		set_legacy_tls(https_ssl);
+#ifdef SSL_OP_ENABLE_KTLS
+	/* OpenSSL hands the record layer to the kernel by itself where
+	   it can; SSL_read() and SSL_write() work just the same. */
+	SSL_set_options(https_ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
+	/* Offer the session from last time, so a reconnect can skip
+	   the full handshake */
+	if (vpninfo->https_resume && can_resume_https(vpninfo))
+		SSL_set_session(https_ssl, vpninfo->https_resume);
+
 	https_bio = BIO_new_socket(ssl_sock, BIO_NOCLOSE);
 	BIO_set_nbio(https_bio, 1);
 	SSL_set_bio(https_ssl, https_bio, https_bio);
@@ -1382,10 +1450,25 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		else if (err == SSL_ERROR_WANT_WRITE)
 			FD_SET(ssl_sock, &wr_set);
 		else {
+			int version_alert = (err == SSL_ERROR_SSL &&
+					     is_tls_version_alert());
+
 			vpn_progress(vpninfo, PRG_ERR, _("SSL connection failure\n"));
 			openconnect_report_ssl_errors(vpninfo);
 			SSL_free(https_ssl);
 			close(ssl_sock);
+			/* Old ASAs choke on anything but TLS 1.0. Try again
+			   with what they like. */
+			if (!vpninfo->tls_priority && !vpninfo->tls_legacy &&
+			    version_alert) {
+				vpn_progress(vpninfo, PRG_INFO,
+					     _("Retrying with TLS 1.0 for %s\n"),
+					     vpninfo->hostname);
+				vpninfo->tls_legacy = 1;
+				goto retry;
+			}
+			/* Only a successful TLS 1.0 connection makes it stick */
+			vpninfo->tls_legacy = 0;
 			return -EINVAL;
 		}
 
@@ -1405,6 +1488,14 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		return -EINVAL;
 	}
 
+	if (set_https_resume_host(vpninfo) && vpninfo->https_resume) {
+		SSL_SESSION_free(vpninfo->https_resume);
+		vpninfo->https_resume = NULL;
+	}
+
+	if (SSL_session_reused(https_ssl))
+		vpn_progress(vpninfo, PRG_DEBUG, _("Resumed TLS session\n"));
+
 	vpninfo->ssl_fd = ssl_sock;
 	vpninfo->https_ssl = https_ssl;
 
@@ -1418,24 +1509,50 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	return 0;
 }
 
+void openconnect_setup_ktls(struct openconnect_info *vpninfo)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+	int tx = BIO_get_ktls_send(SSL_get_wbio(vpninfo->https_ssl));
+	int rx = BIO_get_ktls_recv(SSL_get_rbio(vpninfo->https_ssl));
+
+	if (tx || rx) {
+		vpninfo->ktls_active = 1;
+		vpn_progress(vpninfo, PRG_INFO, _("Using kernel TLS for %s\n"),
+			     rx ? (tx ? _("sending and receiving") : _("receiving")) :
+			     _("sending"));
+	}
+#endif
+}
+
 void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 {
 	if (vpninfo->peer_cert) {
 		X509_free(vpninfo->peer_cert);
 		vpninfo->peer_cert = NULL;
 	}
+	vpninfo->ktls_active = 0;
 	if (vpninfo->https_ssl) {
+		/* Keep the session (or ticket) to resume on reconnect */
+		SSL_SESSION *sess = SSL_get1_session(vpninfo->https_ssl);
+
+		if (sess) {
+			if (vpninfo->https_resume)
+				SSL_SESSION_free(vpninfo->https_resume);
+			vpninfo->https_resume = sess;
+		}
 		SSL_free(vpninfo->https_ssl);
 		vpninfo->https_ssl = NULL;
 	}
 	if (vpninfo->ssl_fd != -1) {
+		unmonitor_fd(vpninfo, vpninfo->ssl_fd);
 		close(vpninfo->ssl_fd);
-		FD_CLR(vpninfo->ssl_fd, &vpninfo->select_rfds);
-		FD_CLR(vpninfo->ssl_fd, &vpninfo->select_wfds);
-		FD_CLR(vpninfo->ssl_fd, &vpninfo->select_efds);
 		vpninfo->ssl_fd = -1;
 	}
 	if (final) {
+		if (vpninfo->https_resume) {
+			SSL_SESSION_free(vpninfo->https_resume);
+			vpninfo->https_resume = NULL;
+		}
 		if (vpninfo->https_ctx) {
 			SSL_CTX_free(vpninfo->https_ctx);
 			vpninfo->https_ctx = NULL;
@@ -58,6 +58,13 @@
 #define AI_NUMERICSERV 0
 #endif
 
+/* How long to give each connection attempt before starting the next one
+   in parallel with it, in ms. As recommended by RFC 8305. */
+#define CONNECT_ATTEMPT_DELAY	250
+/* The address which worked last time gets longer on its own; this is
+   the most that RFC 8305 allows. */
+#define CONNECT_PREFERRED_DELAY	2000
+
 static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 			       const struct sockaddr *addr, socklen_t addrlen)
 {
@@ -92,6 +99,409 @@ static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 	return getpeername(sockfd, (void *)&peer, &peerlen);
 }
 
+/* Start a non-blocking connect() to addr. Returns the socket, or -1 if
+   the attempt failed straight away. *done is set if it has connected
+   already, as it might for a local address. */
+static int start_connect(struct openconnect_info *vpninfo,
+			 struct addrinfo *addr, int *done)
+{
+	int sock;
+
+	sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (sock < 0)
+		return -1;
+
+	fcntl(sock, F_SETFD, fcntl(sock, F_GETFD) | FD_CLOEXEC);
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	if (vpninfo->protect_socket)
+		vpninfo->protect_socket(vpninfo->cbdata, sock);
+
+	*done = 0;
+	if (connect(sock, addr->ai_addr, addr->ai_addrlen) < 0) {
+		if (errno != EINPROGRESS) {
+			close(sock);
+			return -1;
+		}
+	} else
+		*done = 1;
+
+	return sock;
+}
+
+/* Connect to whichever of the addresses answers first, in the manner of
+   RFC 8305 ("Happy Eyeballs"). The address which worked last time is
+   tried first, and the rest are only raced if it fails or doesn't answer
+   within CONNECT_PREFERRED_DELAY ms. They're interleaved by family, with
+   the family that worked last time first. A new attempt is started every
+   CONNECT_ATTEMPT_DELAY ms, or as soon as one fails, without abandoning
+   those already in progress. The first to connect wins and the others
+   are closed. Returns the socket, with *winner set to its address. */
+static int race_connect(struct openconnect_info *vpninfo, struct addrinfo *result,
+			const char *port, struct addrinfo **winner)
+{
+	struct addrinfo *rp, *pref, *other, **addrs;
+	int *socks;
+	int nr_addrs = 0, next = 0, active = 0;
+	int first_af = AF_INET6;
+	int i, preferred = -1;
+	int ret = -1;
+	uint64_t next_start = 0;
+
+	for (rp = result; rp; rp = rp->ai_next)
+		nr_addrs++;
+
+	addrs = calloc(nr_addrs, sizeof(*addrs));
+	socks = calloc(nr_addrs, sizeof(*socks));
+	if (!addrs || !socks) {
+		free(addrs);
+		free(socks);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Interleave the address families, starting with the one that
+	   worked last time (or IPv6, as the RFC says), and keeping the
+	   resolver's order within each. */
+	if (vpninfo->preferred_addrlen)
+		first_af = vpninfo->preferred_addr.ss_family;
+	pref = other = result;
+	for (i = 0; i < nr_addrs; ) {
+		while (pref && pref->ai_family != first_af)
+			pref = pref->ai_next;
+		while (other && other->ai_family == first_af)
+			other = other->ai_next;
+		if (pref) {
+			addrs[i++] = pref;
+			pref = pref->ai_next;
+		}
+		if (other) {
+			addrs[i++] = other;
+			other = other->ai_next;
+		}
+	}
+
+	/* Then move the address which worked last time to the front */
+	for (i = 0; i < nr_addrs; i++) {
+		rp = addrs[i];
+		if (rp->ai_addrlen == vpninfo->preferred_addrlen &&
+		    !memcmp(rp->ai_addr, &vpninfo->preferred_addr, rp->ai_addrlen)) {
+			memmove(addrs + 1, addrs, i * sizeof(*addrs));
+			addrs[0] = rp;
+			preferred = 0;
+			break;
+		}
+	}
+
+	for (i = 0; i < nr_addrs; i++)
+		socks[i] = -1;
+
+	while (1) {
+		uint64_t now = vpn_time_ms();
+		struct timeval tv, *tvp = NULL;
+		fd_set wr_set, rd_set;
+		int maxfd = 0;
+
+		if (next < nr_addrs && (!active || now >= next_start)) {
+			char host[80];
+			int done;
+
+			rp = addrs[next];
+			host[0] = 0;
+			if (!getnameinfo(rp->ai_addr, rp->ai_addrlen, host,
+					 sizeof(host), NULL, 0, NI_NUMERICHOST))
+				vpn_progress(vpninfo, PRG_INFO, vpninfo->proxy_type ?
+						     _("Attempting to connect to proxy %s%s%s:%s\n") :
+						     _("Attempting to connect to server %s%s%s:%s\n"),
+					     rp->ai_family == AF_INET6 ? "[" : "",
+					     host,
+					     rp->ai_family == AF_INET6 ? "]" : "",
+					     port);
+
+			socks[next] = start_connect(vpninfo, rp, &done);
+			if (socks[next] >= 0) {
+				if (done) {
+					ret = next;
+					break;
+				}
+				active++;
+				next_start = now + (next == preferred ?
+						    CONNECT_PREFERRED_DELAY :
+						    CONNECT_ATTEMPT_DELAY);
+			}
+			next++;
+			continue;
+		}
+
+		if (!active)
+			break;
+
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		for (i = 0; i < next; i++) {
+			if (socks[i] < 0)
+				continue;
+			FD_SET(socks[i], &wr_set);
+			if (socks[i] > maxfd)
+				maxfd = socks[i];
+		}
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+
+		if (next < nr_addrs) {
+			tv.tv_sec = (next_start - now) / 1000;
+			tv.tv_usec = ((next_start - now) % 1000) * 1000;
+			tvp = &tv;
+		}
+		select(maxfd + 1, &rd_set, &wr_set, NULL, tvp);
+		if (is_cancel_pending(vpninfo, &rd_set) || vpninfo->got_pause_cmd) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			errno = EINTR;
+			break;
+		}
+
+		for (i = 0; i < next; i++) {
+			struct sockaddr_storage peer;
+			socklen_t peerlen = sizeof(peer);
+
+			if (socks[i] < 0 || !FD_ISSET(socks[i], &wr_set))
+				continue;
+
+			/* Check whether connect() succeeded or failed by using
+			   getpeername(). See http://cr.yp.to/docs/connect.html */
+			if (!getpeername(socks[i], (void *)&peer, &peerlen)) {
+				ret = i;
+				break;
+			}
+			close(socks[i]);
+			socks[i] = -1;
+			active--;
+			/* Don't wait to start the next one */
+			next_start = 0;
+		}
+		if (ret >= 0)
+			break;
+	}
+
+	for (i = 0; i < next; i++) {
+		if (i != ret && socks[i] >= 0)
+			close(socks[i]);
+	}
+	if (ret >= 0) {
+		*winner = addrs[ret];
+		if (addrs[ret]->ai_addrlen <= sizeof(vpninfo->preferred_addr)) {
+			memcpy(&vpninfo->preferred_addr, addrs[ret]->ai_addr,
+			       addrs[ret]->ai_addrlen);
+			vpninfo->preferred_addrlen = addrs[ret]->ai_addrlen;
+		}
+		ret = socks[ret];
+	}
+	free(addrs);
+	free(socks);
+	return ret;
+}
+
+/* Resolved addresses are cached for each host and port for a while, so
+   that reconnects and redirects don't have to wait for the resolver each
+   time. With getaddrinfo_a(), a lookup can also be started in advance by
+   openconnect_preresolve_host(), and is only waited for when the
+   addresses are needed. */
+struct resolved_host {
+	struct resolved_host *next;
+	char *host;		/* As given, which is the cache key */
+	char *name;		/* Without the [] around an IPv6 literal */
+	char port[6];
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	uint64_t expires;
+#ifdef HAVE_GETADDRINFO_A
+	struct gaicb gai;
+	int pending;
+#endif
+};
+
+static void free_resolved(struct resolved_host *r)
+{
+#ifdef HAVE_GETADDRINFO_A
+	if (r->pending) {
+		const struct gaicb *list = &r->gai;
+
+		if (gai_cancel(&r->gai) == EAI_NOTCANCELED) {
+			while (gai_error(&r->gai) == EAI_INPROGRESS)
+				gai_suspend(&list, 1, NULL);
+		}
+		if (!gai_error(&r->gai))
+			freeaddrinfo(r->gai.ar_result);
+	}
+#endif
+	if (r->addrs)
+		freeaddrinfo(r->addrs);
+	free(r->host);
+	free(r->name);
+	free(r);
+}
+
+static void drop_resolved(struct openconnect_info *vpninfo,
+			  struct resolved_host *r)
+{
+	struct resolved_host **p = &vpninfo->resolve_cache;
+
+	while (*p != r)
+		p = &(*p)->next;
+	*p = r->next;
+	free_resolved(r);
+}
+
+void free_resolve_cache(struct openconnect_info *vpninfo)
+{
+	while (vpninfo->resolve_cache)
+		drop_resolved(vpninfo, vpninfo->resolve_cache);
+}
+
+/* Find the cache entry for host and port, discarding any which expired */
+static struct resolved_host *find_resolved(struct openconnect_info *vpninfo,
+					   const char *host, const char *port)
+{
+	struct resolved_host *r, *next;
+	uint64_t now = vpn_time_ms();
+
+	for (r = vpninfo->resolve_cache; r; r = next) {
+		int match = !strcmp(r->host, host) && !strcmp(r->port, port);
+
+		next = r->next;
+#ifdef HAVE_GETADDRINFO_A
+		/* Still being looked up; the caller waits for it */
+		if (r->pending) {
+			if (match)
+				return r;
+			continue;
+		}
+#endif
+		if (now >= r->expires)
+			drop_resolved(vpninfo, r);
+		else if (match)
+			return r;
+	}
+	return NULL;
+}
+
+static struct resolved_host *new_resolved(struct openconnect_info *vpninfo,
+					  const char *host, const char *port)
+{
+	struct resolved_host *r = calloc(1, sizeof(*r));
+	int len = strlen(host);
+
+	if (!r)
+		return NULL;
+
+	r->hints.ai_family = AF_UNSPEC;
+	r->hints.ai_socktype = SOCK_STREAM;
+	r->hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+	r->host = strdup(host);
+	if (len > 2 && host[0] == '[' && host[len - 1] == ']') {
+		/* Solaris has no strndup(). */
+		r->name = malloc(len - 1);
+		if (r->name) {
+			memcpy(r->name, host + 1, len - 2);
+			r->name[len - 2] = 0;
+		}
+		r->hints.ai_flags |= AI_NUMERICHOST;
+	} else
+		r->name = strdup(host);
+
+	if (!r->host || !r->name) {
+		free(r->host);
+		free(r->name);
+		free(r);
+		return NULL;
+	}
+	snprintf(r->port, sizeof(r->port), "%s", port);
+
+	r->next = vpninfo->resolve_cache;
+	vpninfo->resolve_cache = r;
+	return r;
+}
+
+/* Look up host and port, from the cache if possible. The result belongs to
+   the cache, and remains valid until the next call. */
+static int resolve_host(struct openconnect_info *vpninfo, const char *host,
+			const char *port, struct addrinfo **result)
+{
+	struct resolved_host *r = find_resolved(vpninfo, host, port);
+	int err;
+
+	if (r) {
+#ifdef HAVE_GETADDRINFO_A
+		if (r->pending) {
+			const struct gaicb *list = &r->gai;
+
+			while ((err = gai_error(&r->gai)) == EAI_INPROGRESS)
+				gai_suspend(&list, 1, NULL);
+
+			r->pending = 0;
+			if (err)
+				goto failed;
+			r->addrs = r->gai.ar_result;
+			r->expires = vpn_time_ms() + RESOLVE_CACHE_TIME;
+		}
+#endif
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Using cached addresses for host '%s'\n"), host);
+		*result = r->addrs;
+		return 0;
+	}
+
+	r = new_resolved(vpninfo, host, port);
+	if (!r)
+		return -ENOMEM;
+
+	err = getaddrinfo(r->name, r->port, &r->hints, &r->addrs);
+	if (err) {
+		r->addrs = NULL;
+#ifdef HAVE_GETADDRINFO_A
+	failed:
+#endif
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("getaddrinfo failed for host '%s': %s\n"),
+			     r->name, gai_strerror(err));
+		drop_resolved(vpninfo, r);
+		return -EINVAL;
+	}
+	r->expires = vpn_time_ms() + RESOLVE_CACHE_TIME;
+	*result = r->addrs;
+	return 0;
+}
+
+int openconnect_preresolve_host(struct openconnect_info *vpninfo,
+				const char *host, int port)
+{
+#ifdef HAVE_GETADDRINFO_A
+	struct resolved_host *r;
+	struct gaicb *list;
+	char portstr[6];
+
+	snprintf(portstr, sizeof(portstr), "%d", port ? : 443);
+	if (find_resolved(vpninfo, host, portstr))
+		return 0;
+
+	r = new_resolved(vpninfo, host, portstr);
+	if (!r)
+		return -ENOMEM;
+
+	r->gai.ar_name = r->name;
+	r->gai.ar_service = r->port;
+	r->gai.ar_request = &r->hints;
+	list = &r->gai;
+	if (getaddrinfo_a(GAI_NOWAIT, &list, 1, NULL)) {
+		drop_resolved(vpninfo, r);
+		return -EIO;
+	}
+	r->pending = 1;
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
 int connect_https_socket(struct openconnect_info *vpninfo)
 {
 	int ssl_sock = -1;
@@ -127,19 +537,10 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 			return -EINVAL;
 		}
 	} else {
-		struct addrinfo hints, *result, *rp;
+		struct addrinfo *result, *rp;
 		char *hostname;
 		char port[6];
 
-		memset(&hints, 0, sizeof(struct addrinfo));
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
-		hints.ai_protocol = 0;
-		hints.ai_canonname = NULL;
-		hints.ai_addr = NULL;
-		hints.ai_next = NULL;
-
 		/* The 'port' variable is a string because it's easier
 		   this way than if we pass NULL to getaddrinfo() and
 		   then try to fill in the numeric value into
@@ -194,88 +595,54 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 			snprintf(port, 6, "%d", vpninfo->port);
 		}
 
-		if (hostname[0] == '[' && hostname[strlen(hostname)-1] == ']') {
-			/* Solaris has no strndup(). */
-			int len = strlen(hostname) - 2;
-			char *new_hostname = malloc(len + 1);
-			if (!new_hostname)
-				return -ENOMEM;
-			memcpy(new_hostname, hostname + 1, len);
-			new_hostname[len] = 0;
-
-			hostname = new_hostname;
-			hints.ai_flags |= AI_NUMERICHOST;
-		}
-
-		err = getaddrinfo(hostname, port, &hints, &result);
-
-		if (err) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("getaddrinfo failed for host '%s': %s\n"),
-				     hostname, gai_strerror(err));
-			if (hints.ai_flags & AI_NUMERICHOST)
-				free(hostname);
-			return -EINVAL;
-		}
-		if (hints.ai_flags & AI_NUMERICHOST)
-			free(hostname);
+		err = resolve_host(vpninfo, hostname, port, &result);
+		if (err)
+			return err;
 
-		for (rp = result; rp ; rp = rp->ai_next) {
+		ssl_sock = race_connect(vpninfo, result, port, &rp);
+		if (ssl_sock >= 0) {
 			char host[80];
 
 			host[0] = 0;
-			if (!getnameinfo(rp->ai_addr, rp->ai_addrlen, host,
-					 sizeof(host), NULL, 0, NI_NUMERICHOST))
-				vpn_progress(vpninfo, PRG_INFO, vpninfo->proxy_type ?
-						     _("Attempting to connect to proxy %s%s%s:%s\n") :
-						     _("Attempting to connect to server %s%s%s:%s\n"),
-					     rp->ai_family == AF_INET6 ? "[" : "",
-					     host,
-					     rp->ai_family == AF_INET6 ? "]" : "",
-					     port);
+			getnameinfo(rp->ai_addr, rp->ai_addrlen, host,
+				    sizeof(host), NULL, 0, NI_NUMERICHOST);
 
-			ssl_sock = socket(rp->ai_family, rp->ai_socktype,
-					  rp->ai_protocol);
-			if (ssl_sock < 0)
-				continue;
-			fcntl(ssl_sock, F_SETFD, fcntl(ssl_sock, F_GETFD) | FD_CLOEXEC);
-			if (cancellable_connect(vpninfo, ssl_sock, rp->ai_addr, rp->ai_addrlen) >= 0) {
-				/* Store the peer address we actually used, so that DTLS can
-				   use it again later */
-				vpninfo->peer_addr = malloc(rp->ai_addrlen);
-				if (!vpninfo->peer_addr) {
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Failed to allocate sockaddr storage\n"));
-					close(ssl_sock);
-					return -ENOMEM;
-				}
-				vpninfo->peer_addrlen = rp->ai_addrlen;
-				memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
-				/* If no proxy, and if more than one address for the hostname,
-				   ensure that we output the same IP address in authentication
-				   results (from libopenconnect or --authenticate). */
-				if (!vpninfo->proxy && (rp != result || rp->ai_next) && host[0]) {
-					char *p = malloc(strlen(host) + 3);
-					if (p) {
-						free(vpninfo->unique_hostname);
-						vpninfo->unique_hostname = p;
-						if (rp->ai_family == AF_INET6)
-							*p++ = '[';
-						memcpy(p, host, strlen(host));
-						p += strlen(host);
-						if (rp->ai_family == AF_INET6)
-							*p++ = ']';
-						*p = 0;
-					}
+			/* Store the peer address we actually used, so that DTLS can
+			   use it again later */
+			vpninfo->peer_addr = malloc(rp->ai_addrlen);
+			if (!vpninfo->peer_addr) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Failed to allocate sockaddr storage\n"));
+				close(ssl_sock);
+				return -ENOMEM;
+			}
+			vpninfo->peer_addrlen = rp->ai_addrlen;
+			memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
+			/* If no proxy, and if more than one address for the hostname,
+			   ensure that we output the same IP address in authentication
+			   results (from libopenconnect or --authenticate). */
+			if (!vpninfo->proxy && (rp != result || rp->ai_next) && host[0]) {
+				char *p = malloc(strlen(host) + 3);
+				if (p) {
+					free(vpninfo->unique_hostname);
+					vpninfo->unique_hostname = p;
+					if (rp->ai_family == AF_INET6)
+						*p++ = '[';
+					memcpy(p, host, strlen(host));
+					p += strlen(host);
+					if (rp->ai_family == AF_INET6)
+						*p++ = ']';
+					*p = 0;
 				}
-				break;
 			}
-			close(ssl_sock);
-			ssl_sock = -1;
 		}
-		freeaddrinfo(result);
-
 		if (ssl_sock < 0) {
+			struct resolved_host *r = find_resolved(vpninfo, hostname, port);
+
+			/* The addresses may have changed; look them up afresh next time */
+			if (r)
+				drop_resolved(vpninfo, r);
+
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to connect to host %s\n"),
 				     vpninfo->proxy?:vpninfo->hostname);
@@ -533,12 +900,11 @@ void cmd_fd_set(struct openconnect_info *vpninfo, fd_set *fds, int *maxfd)
 	}
 }
 
-void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
+/* Called when cmd_fd is known to be readable */
+void read_cmd_fd(struct openconnect_info *vpninfo)
 {
 	char cmd;
 
-	if (vpninfo->cmd_fd == -1 || !FD_ISSET(vpninfo->cmd_fd, fds))
-		return;
 	if (vpninfo->cmd_fd_write == -1) {
 		/* legacy openconnect_set_cancel_fd() users */
 		vpninfo->got_cancel_cmd = 1;
@@ -561,6 +927,12 @@ void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
 	}
 }
 
+void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
+{
+	if (vpninfo->cmd_fd != -1 && FD_ISSET(vpninfo->cmd_fd, fds))
+		read_cmd_fd(vpninfo);
+}
+
 int is_cancel_pending(struct openconnect_info *vpninfo, fd_set *fds)
 {
 	check_cmd_fd(vpninfo, fds);
@@ -571,13 +943,16 @@ void poll_cmd_fd(struct openconnect_info *vpninfo, int timeout)
 {
 	fd_set rd_set;
 	int maxfd = 0;
-	time_t expiration = time(NULL) + timeout, now;
+	uint64_t expiration = vpn_time_ms() + timeout * 1000, now;
 
 	do {
 		struct timeval tv = { 0 };
+		int left;
 
-		now = time(NULL);
-		tv.tv_sec = now >= expiration ? 0 : expiration - now;
+		now = vpn_time_ms();
+		left = now >= expiration ? 0 : expiration - now;
+		tv.tv_sec = left / 1000;
+		tv.tv_usec = (left % 1000) * 1000;
 
 		FD_ZERO(&rd_set);
 		cmd_fd_set(vpninfo, &rd_set, &maxfd);
@@ -585,3 +960,25 @@ void poll_cmd_fd(struct openconnect_info *vpninfo, int timeout)
 		check_cmd_fd(vpninfo, &rd_set);
 	} while (now < expiration && !vpninfo->got_cancel_cmd && !vpninfo->got_pause_cmd);
 }
+
+/* Whether the saved TLS session was with the server we're connecting to */
+int can_resume_https(struct openconnect_info *vpninfo)
+{
+	return vpninfo->https_resume_host && vpninfo->hostname &&
+		!strcmp(vpninfo->https_resume_host, vpninfo->hostname) &&
+		vpninfo->https_resume_port == vpninfo->port;
+}
+
+/* Called once connected, since any TLS session saved from now on will be
+   with this server. Returns 1 if it's a different server from before, and
+   the session saved from that one must be discarded. */
+int set_https_resume_host(struct openconnect_info *vpninfo)
+{
+	if (can_resume_https(vpninfo))
+		return 0;
+
+	free(vpninfo->https_resume_host);
+	vpninfo->https_resume_host = vpninfo->hostname ? strdup(vpninfo->hostname) : NULL;
+	vpninfo->https_resume_port = vpninfo->port;
+	return 1;
+}
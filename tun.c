@@ -77,7 +77,7 @@
 #define TUN_HAS_AF_PREFIX 1
 #endif
 
-static int set_tun_mtu(struct openconnect_info *vpninfo)
+int set_tun_mtu(struct openconnect_info *vpninfo, int mtu)
 {
 #ifndef __sun__ /* We don't know how to do this on Solaris */
 	struct ifreq ifr;
@@ -91,7 +91,7 @@ static int set_tun_mtu(struct openconnect_info *vpninfo)
 
 	memset(&ifr, 0, sizeof(ifr));
 	strncpy(ifr.ifr_name, vpninfo->ifname, sizeof(ifr.ifr_name) - 1);
-	ifr.ifr_mtu = vpninfo->ip_info.mtu;
+	ifr.ifr_mtu = mtu;
 
 	if (ioctl(net_fd, SIOCSIFMTU, &ifr) < 0)
 		perror(_("SIOCSIFMTU"));
@@ -638,13 +638,10 @@ int openconnect_setup_tun_fd(struct openconnect_info *vpninfo, int tun_fd)
 	fcntl(tun_fd, F_SETFD, FD_CLOEXEC);
 
 	if (vpninfo->tun_fd != -1)
-		FD_CLR(vpninfo->tun_fd, &vpninfo->select_rfds);
+		unmonitor_fd(vpninfo, vpninfo->tun_fd);
 	vpninfo->tun_fd = tun_fd;
 
-	if (vpninfo->select_nfds <= tun_fd)
-		vpninfo->select_nfds = tun_fd + 1;
-
-	FD_SET(tun_fd, &vpninfo->select_rfds);
+	monitor_read_fd(vpninfo, tun_fd);
 
 	fcntl(vpninfo->tun_fd, F_SETFL, fcntl(vpninfo->tun_fd, F_GETFL) | O_NONBLOCK);
 
@@ -702,13 +699,11 @@ int openconnect_setup_tun_device(struct openconnect_info *vpninfo, char *vpnc_sc
 	script_config_tun(vpninfo, "connect");
 
 	/* Ancient vpnc-scripts might not get this right */
-	set_tun_mtu(vpninfo);
+	set_tun_mtu(vpninfo, vpninfo->ip_info.mtu);
 
 	return openconnect_setup_tun_fd(vpninfo, tun_fd);
 }
 
-static struct pkt *out_pkt;
-
 int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 {
 	int work_done = 0;
@@ -719,45 +714,47 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 		prefix_size = sizeof(int);
 #endif
 
-	if (FD_ISSET(vpninfo->tun_fd, &vpninfo->select_rfds)) {
+	update_tx_queue_limit(vpninfo);
+
+	if (is_read_fd_monitored(vpninfo, vpninfo->tun_fd)) {
 		while (1) {
 			int len = vpninfo->ip_info.mtu;
+			struct pkt *pkt = get_rx_pkt(vpninfo, &vpninfo->tun_pkt, len);
 
-			if (!out_pkt) {
-				out_pkt = malloc(sizeof(struct pkt) + len);
-				if (!out_pkt) {
-					vpn_progress(vpninfo, PRG_ERR, "Allocation failed\n");
-					break;
-				}
+			if (!pkt) {
+				vpn_progress(vpninfo, PRG_ERR, "Allocation failed\n");
+				break;
 			}
 
-			len = read(vpninfo->tun_fd, out_pkt->data - prefix_size, len + prefix_size);
+			pkt_push(pkt, prefix_size);
+			len = read(vpninfo->tun_fd, pkt->data, len + prefix_size);
 			if (len <= prefix_size)
 				break;
-			out_pkt->len = len - prefix_size;
+			pkt->len = len;
+			pkt_pull(pkt, prefix_size);
 
 			vpninfo->stats.tx_pkts++;
-			vpninfo->stats.tx_bytes += out_pkt->len;
+			vpninfo->stats.tx_bytes += pkt->len;
 
-			queue_packet(&vpninfo->outgoing_queue, out_pkt);
-			out_pkt = NULL;
+			pkt->queued = vpninfo->now;
+			queue_packet(&vpninfo->outgoing_queue, pkt);
+			vpninfo->tun_pkt = NULL;
 
 			work_done = 1;
-			vpninfo->outgoing_qlen++;
-			if (vpninfo->outgoing_qlen == vpninfo->max_qlen) {
-				FD_CLR(vpninfo->tun_fd, &vpninfo->select_rfds);
+			if (vpninfo->outgoing_queue.bytes >= vpninfo->tx_qlimit) {
+				unmonitor_read_fd(vpninfo, vpninfo->tun_fd);
 				break;
 			}
 		}
-	} else if (vpninfo->outgoing_qlen < vpninfo->max_qlen) {
-		FD_SET(vpninfo->tun_fd, &vpninfo->select_rfds);
+	} else if (vpninfo->outgoing_queue.bytes < vpninfo->tx_qlimit) {
+		monitor_read_fd(vpninfo, vpninfo->tun_fd);
 	}
 
 	/* The kernel returns -ENOMEM when the queue is full, so theoretically
 	   we could handle that and retry... but it doesn't let us poll() for
 	   the no-longer-full situation, so let's not bother. */
-	while (vpninfo->incoming_queue) {
-		struct pkt *this = vpninfo->incoming_queue;
+	while (vpninfo->incoming_queue.head) {
+		struct pkt *this = dequeue_packet(&vpninfo->incoming_queue);
 		unsigned char *data = this->data;
 		int len = this->len;
 
@@ -774,34 +771,32 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout)
 			else if (iph->ip_v == 4)
 				type = AF_INET;
 			else {
-				static int complained = 0;
-				if (!complained) {
-					complained = 1;
+				if (!vpninfo->tun_complained) {
+					vpninfo->tun_complained = 1;
 					vpn_progress(vpninfo, PRG_ERR,
 						     _("Unknown packet (len %d) received: %02x %02x %02x %02x...\n"),
 						     len, data[0], data[1], data[2], data[3]);
 				}
-				free(this);
+				free_pkt(vpninfo, this);
 				continue;
 			}
-			data -= 4;
-			len += 4;
+			data = pkt_push(this, 4);
+			len = this->len;
 			*(int *)data = htonl(type);
 		}
 #endif
-		vpninfo->incoming_queue = this->next;
-
 		if (write(vpninfo->tun_fd, data, len) < 0) {
 			/* Handle death of "script" socket */
 			if (vpninfo->script_tun && errno == ENOTCONN) {
 				vpninfo->quit_reason = "Client connection terminated";
+				free_pkt(vpninfo, this);
 				return 1;
 			}
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to write incoming packet: %s\n"),
 				     strerror(errno));
 		}
-		free(this);
+		free_pkt(vpninfo, this);
 	}
 	/* Work is not done if we just got rid of packets off the queue */
 	return work_done;
@@ -824,6 +819,7 @@ void shutdown_tun(struct openconnect_info *vpninfo)
 #endif
 	}
 
+	unmonitor_fd(vpninfo, vpninfo->tun_fd);
 	if (vpninfo->vpnc_script)
 		close(vpninfo->tun_fd);
 	vpninfo->tun_fd = -1;